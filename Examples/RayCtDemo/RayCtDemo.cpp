@@ -62,12 +62,12 @@ int main(){
   MyScanner.SetReconstruction(40.0, 512);
   MyScanner.ReconAxialFBP();
   // Write data to file
-  std::vector<double> obj_scan = MyScanner.GetProjectionData();
+  const solutio::Sinogram &obj_scan = MyScanner.GetProjectionData();
   std::ofstream fout;
   fout.open("proj.txt");
   for(int n = 0; n < obj_scan.size(); n++) fout << obj_scan[n] << '\n';
   fout.close();
-  std::vector<int> img_scan = MyScanner.GetImageData();
+  const std::vector<int> &img_scan = MyScanner.GetImageData();
   fout.open("image.txt");
   for(int i = 0; i < 512; i++)
   {
@@ -50,7 +50,7 @@ namespace solutio
     return volume;
   }
 
-  double Cylinder::RayPathlength(Ray3 ray)
+  double Cylinder::RayPathlength(const Ray3 &ray)
   {
     double solution[2];
     double L = ray.direction.Magnitude();
@@ -49,7 +49,7 @@ namespace solutio
       double GetHeight(){ return height; }
       // Calc functions
       double CalcVolume();
-      double RayPathlength(Ray3 ray);
+      double RayPathlength(const Ray3 &ray);
     private:
       double radius;
       double height;
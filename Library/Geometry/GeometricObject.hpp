@@ -40,7 +40,7 @@ namespace solutio
   class GeometricObject
   {
     public:
-      virtual double RayPathlength(Ray3 ray){ return 0.0; };
+      virtual double RayPathlength(const Ray3 &ray){ return 0.0; };
     protected:
       Vec3<double> centroid;
       double volume;
@@ -113,63 +113,103 @@ namespace solutio
     }
   }
   
-  std::vector< std::pair<int, double> > GeometricObjectModel::CalcRayPathlength(Ray3 ray)
+  void GeometricObjectModel::InitRayTraceWork(RayTraceWork &work)
   {
-    int parent_id;
+    work.num_objects = object_parent.size();
+    work.pathlengths.clear();
+    work.pathlengths.reserve(work.num_objects);
+    work.object_ids.clear();
+    work.object_ids.reserve(work.num_objects);
+    work.intersect.assign(work.num_objects, 0);
+  }
+
+  int GeometricObjectModel::TraceRay(const Ray3 &ray, RayTraceWork &work,
+      double min_length)
+  {
+    if(work.num_objects != object_parent.size()) InitRayTraceWork(work);
+    int parent_id, object_id;
     double length;
-    std::vector<double> pathlengths;
-    std::vector<int> ray_object_ids;
-    std::vector<bool> ray_intersect(object_parent.size());
-    std::vector< std::pair<int, double> > intersection_list;
-    std::pair<int, double> list_entry;
-    
-    // Check world first
-    length = object_pointers[0]->RayPathlength(ray);
-    if (length < 1e-10)
-    {
-      list_entry.first = -1;
-      list_entry.second = 0.0;
-      intersection_list.push_back(list_entry);
-      return intersection_list;
-    }
-    else
-    {
-      pathlengths.push_back(ray.direction.Magnitude());
-      ray_object_ids.push_back(world_id);
-      ray_intersect[0] = true;
-    }
+    std::vector<double> &pathlengths = work.pathlengths;
+    std::vector<int> &ray_object_ids = work.object_ids;
+    std::vector<char> &ray_intersect = work.intersect;
+    pathlengths.clear();
+    ray_object_ids.clear();
+
+    // Start at outermost level (the "world")
+    pathlengths.push_back(ray.direction.Magnitude());
+    ray_object_ids.push_back(world_id);
+    ray_intersect[world_id] = true;
+
     // Loop for each subsequent level
     for(int m = 1; m < object_levels.size(); m++)
     {
       for(int n = 0; n < object_levels[m].size(); n++)
       {
-        if(!ray_intersect[(object_parent[(object_levels[m][n])])]) continue;
+        object_id = object_levels[m][n];
+        if(!ray_intersect[(object_parent[object_id])])
+        {
+          ray_intersect[object_id] = false;
+          continue;
+        }
         // Check if ray intersects with any children
-        length = object_pointers[(object_levels[m][n])]->RayPathlength(ray);
-        
-        // Save material IDs and path lengths for children, subtract pathlengths
+        length = object_pointers[object_id]->RayPathlength(ray);
+        work.intersection_tests++;
+
+        // Save object IDs and path lengths for children, subtract pathlengths
         // from parents
-        if(length > 1.0e-10)
+        if(length > min_length)
         {
           pathlengths.push_back(length);
-          ray_object_ids.push_back((object_levels[m][n]));
-          ray_intersect[(object_levels[m][n])] = true;
-          
+          ray_object_ids.push_back(object_id);
+          ray_intersect[object_id] = true;
+
           parent_id = 0;
-          while(object_parent[(object_levels[m][n])] !=
-              ray_object_ids[parent_id]) parent_id++;
+          while(object_parent[object_id] != ray_object_ids[parent_id])
+            parent_id++;
           pathlengths[parent_id] -= length;
-          
         }
-        else { ray_intersect[(object_levels[m][n])] = false; }
+        else { ray_intersect[object_id] = false; }
       }
     }
-    for(int n = 0; n < pathlengths.size(); n++){
-      list_entry.first = ray_object_ids[n];
-      list_entry.second = pathlengths[n];
+    return pathlengths.size();
+  }
+
+  int GeometricObjectModel::CalcRayPathlength(const Ray3 &ray,
+      RayTraceWork &work)
+  {
+    // Check world first
+    if(object_pointers[world_id]->RayPathlength(ray) < 1e-10)
+    {
+      work.pathlengths.clear();
+      work.object_ids.clear();
+      return 0;
+    }
+    return TraceRay(ray, work, 1.0e-10);
+  }
+
+  std::vector< std::pair<int, double> > GeometricObjectModel::CalcRayPathlength(
+      const Ray3 &ray)
+  {
+    // Scratch buffers are kept per thread and reused between calls (they
+    // are resized by TraceRay if the model changes)
+    static thread_local RayTraceWork work;
+    std::vector< std::pair<int, double> > intersection_list;
+    std::pair<int, double> list_entry;
+
+    int num_intersections = CalcRayPathlength(ray, work);
+    if(num_intersections == 0)
+    {
+      list_entry.first = -1;
+      list_entry.second = 0.0;
+      intersection_list.push_back(list_entry);
+      return intersection_list;
+    }
+    for(int n = 0; n < num_intersections; n++){
+      list_entry.first = work.object_ids[n];
+      list_entry.second = work.pathlengths[n];
       intersection_list.push_back(list_entry);
     }
-    
+
     return intersection_list;
   }
 }
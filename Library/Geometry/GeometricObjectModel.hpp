@@ -42,14 +42,36 @@
 
 namespace solutio
 {
+  // Caller-owned scratch buffers for ray traversal, so that no memory is
+  // allocated per ray (use one per thread)
+  struct RayTraceWork
+  {
+    RayTraceWork() : num_objects(0), intersection_tests(0) {}
+    int num_objects;
+    // Running count of ray-object intersection tests with this buffer
+    long intersection_tests;
+    std::vector<double> pathlengths;
+    std::vector<int> object_ids;
+    std::vector<char> intersect;
+    std::vector<double> material_lengths;
+  };
+
   class GeometricObjectModel
   {
     public:
       virtual void AddGeometricObject(std::string name, GeometricObject &G,
           std::string parent_name);
       void MakeTree();
-      std::vector< std::pair<int, double> > CalcRayPathlength(Ray3 ray);
+      std::vector< std::pair<int, double> > CalcRayPathlength(const Ray3 &ray);
+      // Allocation-free version; returns number of objects intersected, and
+      // object IDs and path lengths are stored in the work buffers
+      int CalcRayPathlength(const Ray3 &ray, RayTraceWork &work);
+      // Size scratch buffers for this model
+      virtual void InitRayTraceWork(RayTraceWork &work);
     protected:
+      // Trace ray through object tree, starting with the world; objects with
+      // path lengths below min_length are treated as not intersected
+      int TraceRay(const Ray3 &ray, RayTraceWork &work, double min_length);
       void AssignParent(std::string parent);
       std::vector<std::string> object_name;
       std::vector<std::string> object_type;
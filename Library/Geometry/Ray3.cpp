@@ -59,7 +59,7 @@ namespace solutio
     return point;
   }
   
-  double Ray3::GetLength()
+  double Ray3::GetLength() const
   {
     return direction.Magnitude();
   }
@@ -52,7 +52,7 @@ namespace solutio
       void SetRay(Vec3<double> o, Vec3<double> d);
       // Get functions
       Vec3<double> GetPoint(double t);
-      double GetLength();
+      double GetLength() const;
   };
 }
 
@@ -57,7 +57,7 @@ namespace solutio
       }
       // Simple math functions
 	  void Scale(T factor){ x *= factor; y *= factor; z *= factor; };
-	  T Magnitude();
+	  T Magnitude() const;
 	  void Normalize();
   };
 
@@ -74,7 +74,7 @@ namespace solutio
   }
 
   template <class T>
-  T Vec3<T>::Magnitude()
+  T Vec3<T>::Magnitude() const
   {
     return sqrt(pow(x,2) + pow(y,2) + pow(z,2));
   }
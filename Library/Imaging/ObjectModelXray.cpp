@@ -34,9 +34,61 @@
 
 // C++ headers
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <random>
 
 namespace solutio
 {
+  // Exponential function for non-positive arguments, written without
+  // branches or library calls so that loops over energy bins vectorize.
+  // Uses Cody-Waite range reduction and a degree 13 Taylor polynomial
+  // (relative error below 1e-12; arguments below -708 return ~0).
+  static inline double SimdExp(double x)
+  {
+    const double log2e = 1.4426950408889634;
+    const double ln2_hi = 6.93147180369123816490e-01;
+    const double ln2_lo = 1.90821492927058770002e-10;
+    const double round_shift = 6755399441055744.0; // 1.5*2^52
+    // Branch-free clamp, x = max(x, -708)
+    x = 0.5*((x - 708.0) + std::fabs(x + 708.0));
+    // n = round(x/ln2), r = x - n*ln2
+    double t = x*log2e + round_shift;
+    double n = t - round_shift;
+    double r = (x - n*ln2_hi) - n*ln2_lo;
+    double p = 1.0/6227020800.0;
+    p = p*r + 1.0/479001600.0;
+    p = p*r + 1.0/39916800.0;
+    p = p*r + 1.0/3628800.0;
+    p = p*r + 1.0/362880.0;
+    p = p*r + 1.0/40320.0;
+    p = p*r + 1.0/5040.0;
+    p = p*r + 1.0/720.0;
+    p = p*r + 1.0/120.0;
+    p = p*r + 1.0/24.0;
+    p = p*r + 1.0/6.0;
+    p = p*r + 0.5;
+    p = p*r + 1.0;
+    p = p*r + 1.0;
+    // Scale by 2^n; the low bits of t hold n, so the exponent bits of 2^n
+    // are built with integer operations only (unsigned, so the shift drops
+    // the high bits without overflow)
+    uint64_t bits;
+    double scale;
+    std::memcpy(&bits, &t, sizeof(double));
+    bits = (bits + 1023) << 52;
+    std::memcpy(&scale, &bits, sizeof(double));
+    return p*scale;
+  }
+
+  ObjectModelXray::ObjectModelXray()
+  {
+    lut_points = 0;
+    verbose = true;
+  }
+
   void ObjectModelXray::AddMaterial(std::string folder, std::string name)
   {
     NistPad NewMat(folder, name);
@@ -83,100 +135,435 @@ namespace solutio
     AssignMaterial(material_name);
   }
 
-  void ObjectModelXray::TabulateAttenuationLists(std::vector<double> energies,
-      std::vector<double> spectrum)
+  double ObjectModelXray::TabulateAttenuationLists(
+      std::vector<double> energies, std::vector<double> spectrum,
+      double max_error)
   {
+    tabulated_energies.clear();
+    tabulated_weights.clear();
+    tabulated_mu.clear();
+    lut_points = 0;
+    lut_log_transmission.clear();
+
+    // Keep only energy bins that contribute to the spectrum
     for(int e = 0; e < energies.size(); e++)
     {
+      if(spectrum[e] == 0.0) continue;
       tabulated_energies.push_back(energies[e]);
+      tabulated_weights.push_back(spectrum[e]);
     }
-    for(int n = 0; n < MuData.size(); n++)
+    // Pack attenuation coefficients contiguously, one block per material
+    int num_bins = tabulated_energies.size();
+    int num_materials = MuData.size();
+    tabulated_mu.resize(num_materials*num_bins);
+    for(int n = 0; n < num_materials; n++)
+    {
+      for(int k = 0; k < num_bins; k++)
+      {
+        tabulated_mu[num_bins*n + k] =
+            MuData[n].LinearAttenuation(tabulated_energies[k]);
+      }
+    }
+    if(max_error <= 0.0 || num_bins < 2 || num_materials == 0) return 0.0;
+
+    // Spectrum-weighted mean attenuation of each material
+    double total_weight = 0.0;
+    for(int k = 0; k < num_bins; k++) total_weight += tabulated_weights[k];
+    std::vector<double> mean_mu(num_materials, 0.0);
+    for(int m = 0; m < num_materials; m++)
+    {
+      for(int k = 0; k < num_bins; k++)
+      {
+        mean_mu[m] += tabulated_weights[k]*tabulated_mu[num_bins*m + k];
+      }
+      mean_mu[m] /= total_weight;
+    }
+
+    // Test path lengths: each material alone and all materials together,
+    // over optical depths (at the mean attenuation) from 0.1 to 10
+    const double depths[] = {0.1, 0.3, 1.0, 2.0, 3.0, 5.0, 7.0, 10.0};
+    const int num_depths = 8;
+    std::vector< std::vector<double> > test_lengths;
+    std::vector<double> full_transmission;
+    for(int n = 0; n <= num_materials; n++)
     {
-      std::vector<double> current_list;
-      for(int e = 0; e < energies.size(); e++)
+      double mean_sum = 0.0;
+      for(int m = 0; m < num_materials; m++)
       {
-        if(spectrum[e] == 0.0)
+        if(n == num_materials || m == n) mean_sum += mean_mu[m];
+      }
+      if(mean_sum <= 0.0) continue;
+      for(int d = 0; d < num_depths; d++)
+      {
+        std::vector<double> lengths(num_materials, 0.0);
+        for(int m = 0; m < num_materials; m++)
         {
-          current_list.push_back(0.0);
-          continue;
+          if(n == num_materials || m == n) lengths[m] = depths[d] / mean_sum;
         }
-        else
+        test_lengths.push_back(lengths);
+        full_transmission.push_back(EnergyTransmission(&lengths[0]));
+      }
+    }
+
+    // Exact transmission of each bin for each test path
+    const int num_tests = test_lengths.size();
+    std::vector<double> bin_transmission(size_t(num_bins)*num_tests);
+    for(int k = 0; k < num_bins; k++)
+    {
+      for(int t = 0; t < num_tests; t++)
+      {
+        double exponent = 0.0;
+        for(int m = 0; m < num_materials; m++)
         {
-          current_list.push_back(MuData[n].LinearAttenuation(energies[e]));
+          exponent += tabulated_mu[num_bins*m + k]*test_lengths[t][m];
         }
+        bin_transmission[num_tests*k + t] =
+            tabulated_weights[k]*exp(-exponent);
       }
-      tabulated_mu_lists.push_back(current_list);
     }
+
+    // Agglomerative clustering of neighboring energy bins. Each group is
+    // represented by its weighted mean energy and attenuation coefficients;
+    // the exact transmission of a group is the sum over its bins. The pair
+    // of neighboring groups whose merge gives the smallest transmission
+    // error is merged, until the total error would exceed max_error.
+    std::vector<double> g_weight = tabulated_weights;
+    std::vector<double> g_energy(num_bins);
+    std::vector< std::vector<double> > g_mu(num_bins,
+        std::vector<double>(num_materials));
+    std::vector< std::vector<double> > g_exact(num_bins,
+        std::vector<double>(num_tests));
+    for(int k = 0; k < num_bins; k++)
+    {
+      g_energy[k] = tabulated_weights[k]*tabulated_energies[k];
+      for(int m = 0; m < num_materials; m++)
+      {
+        g_mu[k][m] = tabulated_weights[k]*tabulated_mu[num_bins*m + k];
+      }
+      for(int t = 0; t < num_tests; t++)
+      {
+        g_exact[k][t] = bin_transmission[num_tests*k + t];
+      }
+    }
+    // Signed error (representative - exact) of each group for each test
+    std::vector< std::vector<double> > g_error(num_bins,
+        std::vector<double>(num_tests, 0.0));
+    std::vector<double> total_error(num_tests, 0.0);
+    double error = 0.0;
+    std::vector<double> merged_mu(num_materials), merged_error(num_tests);
+    while(g_weight.size() > 1)
+    {
+      // Find the best pair to merge
+      int best = -1;
+      double best_error = HUGE_VAL;
+      for(int g = 0; g+1 < g_weight.size(); g++)
+      {
+        double w = g_weight[g] + g_weight[g+1];
+        double pair_error = 0.0;
+        for(int t = 0; t < num_tests; t++)
+        {
+          double exponent = 0.0;
+          for(int m = 0; m < num_materials; m++)
+          {
+            exponent += (g_mu[g][m] + g_mu[g+1][m])/w*test_lengths[t][m];
+          }
+          double e = w*exp(-exponent) - g_exact[g][t] - g_exact[g+1][t];
+          e = std::fabs(total_error[t] - g_error[g][t] - g_error[g+1][t] + e)
+              / full_transmission[t];
+          pair_error = std::max(pair_error, e);
+        }
+        if(pair_error < best_error)
+        {
+          best_error = pair_error;
+          best = g;
+        }
+      }
+      if(best_error > max_error) break;
+
+      // Merge the pair
+      error = best_error;
+      double w = g_weight[best] + g_weight[best+1];
+      for(int m = 0; m < num_materials; m++)
+      {
+        g_mu[best][m] += g_mu[best+1][m];
+      }
+      for(int t = 0; t < num_tests; t++)
+      {
+        g_exact[best][t] += g_exact[best+1][t];
+        double exponent = 0.0;
+        for(int m = 0; m < num_materials; m++)
+        {
+          exponent += g_mu[best][m]/w*test_lengths[t][m];
+        }
+        double e = w*exp(-exponent) - g_exact[best][t];
+        total_error[t] += e - g_error[best][t] - g_error[best+1][t];
+        g_error[best][t] = e;
+      }
+      g_weight[best] = w;
+      g_energy[best] += g_energy[best+1];
+      g_weight.erase(g_weight.begin() + best + 1);
+      g_energy.erase(g_energy.begin() + best + 1);
+      g_mu.erase(g_mu.begin() + best + 1);
+      g_exact.erase(g_exact.begin() + best + 1);
+      g_error.erase(g_error.begin() + best + 1);
+    }
+
+    // Store compressed tables
+    const int num_groups = g_weight.size();
+    tabulated_energies.resize(num_groups);
+    tabulated_weights = g_weight;
+    tabulated_mu.resize(num_materials*num_groups);
+    for(int g = 0; g < num_groups; g++)
+    {
+      tabulated_energies[g] = g_energy[g] / g_weight[g];
+      for(int m = 0; m < num_materials; m++)
+      {
+        tabulated_mu[num_groups*m + g] = g_mu[g][m] / g_weight[g];
+      }
+    }
+    if(verbose)
+    {
+      std::cout << "Spectrum compressed from " << num_bins << " to " <<
+          num_groups << " energy bins (max. transmission error " << error <<
+          ")\n";
+    }
+    return error;
   }
 
   bool ObjectModelXray::IsListTabulated()
   {
-    return (tabulated_mu_lists.size() != 0);
+    return (tabulated_mu.size() != 0);
+  }
+
+  void ObjectModelXray::InitRayTraceWork(RayTraceWork &work)
+  {
+    GeometricObjectModel::InitRayTraceWork(work);
+    work.material_lengths.assign(MuData.size(), 0.0);
+  }
+
+  void ObjectModelXray::CalcMaterialPathlengths(const Ray3 &ray,
+      RayTraceWork &work)
+  {
+    if(work.material_lengths.size() != MuData.size()) InitRayTraceWork(work);
+    int num_intersections = TraceRay(ray, work, 1.0e-6);
+    for(int n = 0; n < MuData.size(); n++) work.material_lengths[n] = 0.0;
+    for(int n = 0; n < num_intersections; n++)
+    {
+      work.material_lengths[(object_material_id[(work.object_ids[n])])] +=
+          work.pathlengths[n];
+    }
+  }
+
+  double ObjectModelXray::GetRayAttenuation(const Ray3 &ray,
+      RayTraceWork &work)
+  {
+    CalcMaterialPathlengths(ray, work);
+    return SpectralTransmission(work.material_lengths.data());
   }
 
-  double ObjectModelXray::GetRayAttenuation(Ray3 ray,
-      std::vector<double> spectrum)
+  double ObjectModelXray::GetRayAttenuation(const Ray3 &ray,
+      const std::vector<double> &spectrum)
   {
-    int parent_id;
-    double length;
-    std::vector<double> pathlengths;
-    std::vector<int> ray_object_ids;
-    std::vector<int> ray_materials;
-    std::vector<bool> ray_intersect(object_parent.size());
+    // Scratch buffers are kept per thread and reused between calls
+    static thread_local RayTraceWork work;
+    if(IsListTabulated()) return GetRayAttenuation(ray, work);
 
-    // Start at outermost level (the "world")
-    pathlengths.push_back(ray.direction.Magnitude());
-    ray_object_ids.push_back(world_id);
-    ray_materials.push_back(object_material_id[world_id]);
-    ray_intersect[0] = true;
+    // Untabulated data: sum up path lengths and attenuation coefficients
+    // (path lengths from the virtual function, so subclasses are traced
+    // with their own geometry)
+    CalcMaterialPathlengths(ray, work);
+    const double * lengths = work.material_lengths.data();
+    double total_sum = 0.0;
+    for(int e = 0; e < spectrum.size(); e++){
+      if(spectrum[e] == 0.0) continue;
+      double energy_sum = 0.0;
+      for(int m = 0; m < MuData.size(); m++){
+        if(lengths[m] == 0.0) continue;
+        energy_sum += (MuData[m].LinearAttenuation(double(e)) * lengths[m]);
+      }
+      total_sum += (spectrum[e] * exp(-energy_sum));
+    }
+    return total_sum;
+  }
 
-    // Loop for each subsequent level
+  double ObjectModelXray::SpectralTransmission(const double material_lengths[])
+  {
+    if(lut_points != 0) return InterpolateTransmission(material_lengths);
+    return EnergyTransmission(material_lengths);
+  }
 
-    for(int m = 1; m < object_levels.size(); m++)
+  double ObjectModelXray::EnergyTransmission(const double material_lengths[])
+  {
+    // Energy bins are processed in fixed-size blocks, so that the exponent
+    // buffer stays on the stack and in cache
+    const int block_size = 64;
+    const int num_bins = tabulated_weights.size();
+    const int num_materials = MuData.size();
+    const double * weights = tabulated_weights.data();
+    double exponent[block_size];
+    double total_sum = 0.0;
+    for(int k0 = 0; k0 < num_bins; k0 += block_size)
     {
-      for(int n = 0; n < object_levels[m].size(); n++)
+      const int nk = std::min(block_size, num_bins-k0);
+      for(int k = 0; k < nk; k++) exponent[k] = 0.0;
+      // Sum of mu*L over materials the ray passes through
+      for(int n = 0; n < num_materials; n++)
       {
-        if(!ray_intersect[(object_parent[(object_levels[m][n])])]) continue;
-        // Check if ray intersects with any children
-        length = object_pointers[(object_levels[m][n])]->RayPathlength(ray);
-
-        // Save material IDs and path lengths for children, subtract pathlengths
-        // from parents
-        if(length > 1.0e-6)
-        {
-          pathlengths.push_back(length);
-          ray_object_ids.push_back((object_levels[m][n]));
-          ray_materials.push_back(object_material_id[(object_levels[m][n])]);
-          ray_intersect[(object_levels[m][n])] = true;
+        const double L = material_lengths[n];
+        if(L == 0.0) continue;
+        const double * mu = &tabulated_mu[num_bins*n + k0];
+        #pragma omp simd
+        for(int k = 0; k < nk; k++) exponent[k] += mu[k]*L;
+      }
+      // Weighted sum of transmission over energy
+      double block_sum = 0.0;
+      #pragma omp simd reduction(+:block_sum)
+      for(int k = 0; k < nk; k++)
+      {
+        block_sum += weights[k0+k]*SimdExp(-exponent[k]);
+      }
+      total_sum += block_sum;
+    }
+    return total_sum;
+  }
 
-          parent_id = 0;
-          while(object_parent[(object_levels[m][n])] !=
-              ray_object_ids[parent_id]) parent_id++;
-          pathlengths[parent_id] -= length;
+  bool ObjectModelXray::TabulateTransmission(double max_error,
+      double max_length)
+  {
+    lut_points = 0;
+    lut_log_transmission.clear();
+    const int num_materials = MuData.size();
+    if(!IsListTabulated() || num_materials == 0 || num_materials > 3)
+    {
+      std::cout << "Error: transmission table needs tabulated lists and " <<
+          "1 to 3 materials!\n";
+      return false;
+    }
 
-        }
-        else { ray_intersect[(object_levels[m][n])] = false; }
+    // Path length range of each material, limited to an optical depth of 20
+    // at the lowest attenuation coefficient in the spectrum
+    const int num_bins = tabulated_weights.size();
+    for(int m = 0; m < num_materials; m++)
+    {
+      double min_mu = HUGE_VAL;
+      for(int k = 0; k < num_bins; k++)
+      {
+        min_mu = std::min(min_mu, tabulated_mu[num_bins*m + k]);
       }
+      lut_max[m] = max_length;
+      if(min_mu > 0.0) lut_max[m] = std::min(max_length, 20.0/min_mu);
     }
-    // Sum up path lengths and attenuation coefficients
-    double total_sum = 0.0, energy, mu;
-    for(int e = 0; e < spectrum.size(); e++){
-      if(spectrum[e] == 0.0) continue;
-      double energy_sum = 0.0;
-      for(int n = 0; n < pathlengths.size(); n++){
-        if(!IsListTabulated())
+
+    // Refine the grid (halving the spacing) until the error at test points
+    // is small enough, or the next table would be too large
+    const size_t max_table_size = size_t(1) << 24;
+    const int max_tests = 4096;
+    std::mt19937 generator(12345);
+    double zero_lengths[3] = {0.0, 0.0, 0.0};
+    const double min_transmission =
+        exp(-20.0)*EnergyTransmission(zero_lengths);
+    int n_points = 9;
+    double error = HUGE_VAL;
+    while(true)
+    {
+      // Fill table with exact values
+      size_t table_size = 1;
+      for(int m = 0; m < num_materials; m++) table_size *= n_points;
+      lut_points = n_points;
+      lut_log_transmission.resize(table_size);
+      #pragma omp parallel for
+      for(long i = 0; i < long(table_size); i++)
+      {
+        double lengths[3];
+        long index = i;
+        for(int m = 0; m < num_materials; m++)
         {
-          energy_sum += (MuData[(ray_materials[n])].LinearAttenuation(double(e)) * pathlengths[n]);
+          double u = double(index % n_points) / double(n_points-1);
+          lengths[m] = lut_max[m]*u*u;
+          index /= n_points;
         }
-        else
+        lut_log_transmission[i] = log(EnergyTransmission(lengths));
+      }
+
+      // Relative error at cell centers (random cells if there are many);
+      // paths with transmission below exp(-20) of the unattenuated beam are
+      // left out, as no photons reach the detector
+      long num_cells = 1;
+      for(int m = 0; m < num_materials; m++) num_cells *= (n_points-1);
+      int num_tests = int(std::min(num_cells, long(max_tests)));
+      std::uniform_int_distribution<int> cell(0, n_points-2);
+      error = 0.0;
+      for(int t = 0; t < num_tests; t++)
+      {
+        double lengths[3];
+        long index = t;
+        for(int m = 0; m < num_materials; m++)
         {
-          energy_sum += (tabulated_mu_lists[(ray_materials[n])][e] * pathlengths[n]);
+          int c = (num_cells <= max_tests) ? int(index % (n_points-1)) :
+              cell(generator);
+          index /= (n_points-1);
+          double u = (double(c) + 0.5) / double(n_points-1);
+          lengths[m] = lut_max[m]*u*u;
         }
+        double exact = EnergyTransmission(lengths);
+        if(exact < min_transmission) continue;
+        double approx = InterpolateTransmission(lengths);
+        error = std::max(error, std::fabs(approx - exact) / exact);
       }
-      total_sum += (spectrum[e] * exp(-energy_sum));
+      if(error <= max_error) break;
+
+      size_t next_size = 1;
+      for(int m = 0; m < num_materials; m++) next_size *= (2*n_points - 1);
+      if(next_size > max_table_size)
+      {
+        std::cout << "Warning: transmission table error tolerance not met!\n";
+        break;
+      }
+      n_points = 2*n_points - 1;
     }
 
-    return total_sum;
+    if(verbose)
+    {
+      std::cout << "Transmission table: " << lut_points << " points per " <<
+          "material, " << (lut_log_transmission.size()*sizeof(double))/1.0e6 <<
+          " MB, max. transmission error " << error << '\n';
+    }
+    return true;
+  }
+
+  // Multilinear interpolation of log transmission; path lengths past the
+  // grid are extrapolated from the last cell
+  double ObjectModelXray::InterpolateTransmission(
+      const double material_lengths[])
+  {
+    const int num_materials = MuData.size();
+    const int last = lut_points - 2;
+    int index[3] = {0, 0, 0};
+    double f[3] = {0.0, 0.0, 0.0};
+    for(int m = 0; m < num_materials; m++)
+    {
+      double u = sqrt(std::max(material_lengths[m], 0.0) / lut_max[m]) *
+          double(lut_points-1);
+      index[m] = (u < double(last)) ? int(u) : last;
+      f[m] = u - double(index[m]);
+    }
+    // Sum over the corners of the cell
+    const double * table = lut_log_transmission.data();
+    double value = 0.0;
+    for(int corner = 0; corner < (1 << num_materials); corner++)
+    {
+      long offset = 0, stride = 1;
+      double weight = 1.0;
+      for(int m = 0; m < num_materials; m++)
+      {
+        int bit = (corner >> m) & 1;
+        offset += stride*(index[m] + bit);
+        weight *= bit ? f[m] : (1.0 - f[m]);
+        stride *= lut_points;
+      }
+      value += weight*table[offset];
+    }
+    return exp(value);
   }
 
   void ObjectModelXray::Print()
@@ -42,6 +42,8 @@ namespace solutio
   class ObjectModelXray : public GeometricObjectModel
   {
     public:
+      // Default constructor
+      ObjectModelXray();
       // Add a NistPad material
       void AddMaterial(std::string folder, std::string name);
       void AddMaterial(std::string folder, std::string name,
@@ -53,20 +55,61 @@ namespace solutio
       // Add object to list
       void AddObject(std::string name, GeometricObject &G,
           std::string parent_name, std::string material_name);
-      // Create preset lists of attenuation coefficients
-      void TabulateAttenuationLists(std::vector<double> energies,
-          std::vector<double> spectrum);
+      // Create preset lists of attenuation coefficients (energy bins with zero
+      // spectrum weight are left out of the tables). If max_error > 0, the
+      // spectrum is compressed to the fewest groups of neighboring bins whose
+      // transmission stays within max_error (relative) of the full spectrum
+      // for a set of test path lengths. Returns the achieved error.
+      double TabulateAttenuationLists(std::vector<double> energies,
+          std::vector<double> spectrum, double max_error = 0.0);
       bool IsListTabulated();
-      // Get fractional photon ray attenuation through object model
-      double GetRayAttenuation(Ray3 ray, std::vector<double> spectrum);
+      // Precompute a transmission lookup table over material path lengths
+      // (models with up to 3 materials; requires tabulated lists), used by
+      // SpectralTransmission instead of the energy loop. Path lengths up to
+      // max_length (cm) are covered; the grid is refined until the relative
+      // transmission error at cell centers is below max_error. Returns false
+      // if no table was made. Tabulating the lists again removes the table.
+      bool TabulateTransmission(double max_error, double max_length);
+      bool IsTransmissionTabulated() { return (lut_points != 0); }
+      // Print spectral compression and transmission table results (default
+      // true); warnings are always printed
+      void SetVerbose(bool print) { verbose = print; }
+      // Get fractional photon ray attenuation through object model (if the
+      // lists are tabulated, the tabulated spectrum is used)
+      double GetRayAttenuation(const Ray3 &ray,
+          const std::vector<double> &spectrum);
+      // Allocation-free version using caller-owned scratch buffers (requires
+      // tabulated lists)
+      double GetRayAttenuation(const Ray3 &ray, RayTraceWork &work);
+      // Total path length through each material, stored in
+      // work.material_lengths (one entry per material)
+      virtual void CalcMaterialPathlengths(const Ray3 &ray, RayTraceWork &work);
+      // Size scratch buffers for this model
+      void InitRayTraceWork(RayTraceWork &work);
+      // Polychromatic transmission for a set of path lengths (one per
+      // material), using the tabulated spectrum and attenuation lists
+      double SpectralTransmission(const double material_lengths[]);
+      // Same, always evaluated from the energy bins
+      double EnergyTransmission(const double material_lengths[]);
       //
       void Print();
-    private:
+    protected:
       std::vector<std::string> object_material_name;
       std::vector<int> object_material_id;
       std::vector<NistPad> MuData;
+      // Tabulated data, for non-zero spectrum bins only; attenuation
+      // coefficients are packed material-major (mu[num_bins*material + bin])
       std::vector<double> tabulated_energies;
-      std::vector< std::vector<double> > tabulated_mu_lists;
+      std::vector<double> tabulated_weights;
+      std::vector<double> tabulated_mu;
+      // Transmission lookup table: log of transmission at path lengths
+      // L = lut_max[m]*u^2 on a uniform grid of lut_points values of u per
+      // material (first material fastest)
+      int lut_points;
+      double lut_max[3];
+      std::vector<double> lut_log_transmission;
+      double InterpolateTransmission(const double material_lengths[]);
+      bool verbose;
   };
 }
 
@@ -37,22 +37,153 @@
 #include <fstream>
 #include <complex>
 #include <algorithm>
+#include <random>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 // C headers
 #include <cstdlib>
+#include <climits>
+#include <omp.h>
 
 // Custom headers
 #include "Tasmip.hpp"
 #include "Utilities/DataInterpolation.hpp"
-#include "Utilities/Statistics.hpp"
+#include "Utilities/FileIO.hpp"
+#include "Utilities/BoundedQueue.hpp"
 #include "Utilities/fftw++-2.05/Array.h"
 #include "Utilities/fftw++-2.05/fftw++.h"
 
 namespace solutio
 {
+  // Noise generator streams for the air scan and the acquired views (noise
+  // realizations use their realization number)
+  static const unsigned long long air_scan_stream = ~0ULL;
+  static const unsigned long long acquisition_stream = ~0ULL - 1;
+
+  // Batched ramp filtering setup. All views are zero-padded into one
+  // buffer, and transformed in place with a single real-to-complex plan and
+  // a single complex-to-real plan. The filter is for equiangular fan-beam
+  // data (spacing = fan angle step) or parallel-beam data (spacing =
+  // detector step).
+  struct RayCT::RampFilterPlan
+  {
+    RampFilterPlan(int n_views, int n_channels, double d_sample, bool par,
+        int n_threads);
+    ~RampFilterPlan(){ utils::deleteAlign(buffer); }
+    // Configuration this plan was built for
+    int num_views;
+    int num_channels;
+    double spacing;
+    bool parallel;
+    int threads;
+    // Padded length of each view, and offset of the data within it
+    unsigned int padded_size;
+    int proj_padding;
+    // Complex values per view (padded_size/2+1); real data for view n
+    // starts at (double *)(buffer + freq_size*n)
+    unsigned int freq_size;
+    Complex * buffer;
+    // Magnitude of ramp filter response for non-negative frequencies
+    std::vector<double> ramp_response;
+    std::unique_ptr<fftwpp::mrcfft1d> forward;
+    std::unique_ptr<fftwpp::mcrfft1d> backward;
+  };
+
+  RayCT::RampFilterPlan::RampFilterPlan(int n_views, int n_channels,
+      double d_sample, bool par, int n_threads)
+  {
+    num_views = n_views;
+    num_channels = n_channels;
+    spacing = d_sample;
+    parallel = par;
+    threads = n_threads;
+
+    int two_power = 0;
+    while(pow(2, two_power) < (2*num_channels-1)) two_power++;
+    padded_size = pow(2, two_power);
+    proj_padding = (padded_size-num_channels)/2;
+    freq_size = padded_size/2 + 1;
+
+    // Create ramp filter in spatial domain
+    const int filter_size = (2*(num_channels-1)) + 1;
+    int nf;
+    int filter_padding = (padded_size-filter_size-1)/2;
+    Array::array1<Complex> ramp_filter(padded_size, sizeof(Complex));
+    for(int f = 0; f < padded_size; f++)
+    {
+      ramp_filter[f] = 0.0;
+      if(f < filter_padding || f > (filter_size+filter_padding-1)) continue;
+      nf = (-num_channels+1) + (f-filter_padding);
+      if(nf == 0) ramp_filter[f] = 1 / (8*pow(spacing,2));
+      else if(nf % 2 != 0 && parallel)
+      {
+        ramp_filter[f] = -0.5 / pow((M_PI*nf*spacing),2);
+      }
+      else if(nf % 2 != 0)
+      {
+        ramp_filter[f] = -0.5 / pow((M_PI*sin(nf*spacing)),2);
+      }
+    }
+
+    // Take FFT; the magnitude is symmetric, so only the non-negative
+    // frequencies are needed for the real-to-complex transforms
+    fftwpp::fft1d Filter(padded_size, -1);
+    Filter.fft(ramp_filter);
+    ramp_response.resize(freq_size);
+    for(int f = 0; f < freq_size; f++) ramp_response[f] = abs(ramp_filter[f]);
+
+    // In-place batched transforms over all views
+    buffer = utils::ComplexAlign(size_t(freq_size)*num_views);
+    forward.reset(new fftwpp::mrcfft1d(padded_size, num_views, 1, 1,
+        2*freq_size, freq_size, (double *)buffer, buffer, threads));
+    backward.reset(new fftwpp::mcrfft1d(padded_size, num_views, 1, 1,
+        freq_size, 2*freq_size, buffer, (double *)buffer, threads));
+  }
+
+  RayCT::RayCT()
+  {
+    num_threads = 0;
+    single_precision_storage = false;
+    projection_file = "";
+    slice_spacing = 0.0;
+    axial_z = 0.0;
+    filtration = 0.0;
+    filter_material = "Aluminum";
+    bhc_max_thickness = 200.0;
+    spectral_tolerance = 0.0;
+    transmission_tolerance = 0.0;
+    pathlength_model_materials = 0;
+    pathlength_views = 0;
+    pathlength_radius = 0.0;
+    pathlength_channels = 0;
+    pathlength_channel_width = 0.0;
+    pathlength_rows = 0;
+    pathlength_row_width = 0.0;
+    pathlength_proj_per_rotation = 0;
+    random_seed = (unsigned long long)time(0);
+    checkpoint_file = "";
+    checkpoint_interval = 0;
+    checkpoint_count_offset = 0;
+    filtered_mu_water = 0.0;
+    filtered_mu_air = 0.0;
+    verbose = true;
+    float_backprojection = false;
+    keep_expected_counts = false;
+  }
+
+  RayCT::~RayCT()
+  {
+    WaitForWrites();
+  }
+
   void RayCT::SetNistDataFolder(std::string folder)
   {
     data_folder = folder;
+    spectral_cache.clear();
   }
 
   void RayCT::SetGeometry(double radius, int n_c, double d_c, int n_r,
@@ -70,7 +201,26 @@ namespace solutio
     d_fan_angle = (2.0*channel_width) / (2.0*scanner_radius);
     scan_fov = 2.0*scanner_radius*sin(0.5*fan_angle);
 
-    std::cout << fan_angle << '\t' << d_fan_angle << '\t' << scan_fov << '\n';
+    // Detector layout; elements lie on an arc of radius 2R centered at the
+    // source, at (R,0,0) for angle 0
+    channel_dx.resize(num_channels);
+    channel_dy.resize(num_channels);
+    for(int c = 0; c < num_channels; c++)
+    {
+      double beta = M_PI - fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle;
+      channel_dx[c] = 2.0*scanner_radius*cos(beta);
+      channel_dy[c] = 2.0*scanner_radius*sin(beta);
+    }
+    row_dz.resize(num_rows);
+    for(int r = 0; r < num_rows; r++)
+    {
+      row_dz[r] = 2.0*row_width*(double(r) - (double(num_rows)/2.0) + 0.5);
+    }
+
+    if(verbose)
+    {
+      std::cout << fan_angle << '\t' << d_fan_angle << '\t' << scan_fov << '\n';
+    }
   }
 
   void RayCT::SetAcquisition(int kVp, double photons, int projs)
@@ -80,6 +230,12 @@ namespace solutio
     proj_per_rotation = projs;
   }
 
+  void RayCT::SetFiltration(double mm, std::string material)
+  {
+    filtration = mm;
+    filter_material = material;
+  }
+
   void RayCT::SetReconstruction(double r_fov, int m_size)
   {
     if(r_fov > scan_fov)
@@ -92,51 +248,70 @@ namespace solutio
     matrix_size = m_size;
   }
 
-  void RayCT::AcquireAirScan()
+  void RayCT::SetSpectralCompression(double max_error)
+  {
+    spectral_tolerance = max_error;
+  }
+
+  void RayCT::SetTransmissionTable(double max_error)
   {
-    // Clear air scan data vector if not empty
-    if(air_scan_data.size() != 0) air_scan_data.clear();
+    transmission_tolerance = max_error;
+  }
 
-    // Set source spectrum
-    std::vector<double> energies;
-    for(int e = 0; e < 151; e++){ energies.push_back(double(e)); }
-    std::vector<double> source_spectrum = Tasmip(tube_potential, 0.0,
-        "Aluminum", data_folder);
+  void RayCT::SetBHCMaxThickness(double max_cm)
+  {
+    bhc_max_thickness = max_cm;
+  }
 
-    // Get attenuation data, from NIST database, and make data table
-    std::vector<double> air_data_table;
-    air_data_table.push_back(0.0);
-    NistPad Air(data_folder, "Air");
-    for(int e = 1; e < 151; e++)
-    {
-      air_data_table.push_back(Air.LinearAttenuation(energies[e]/1000.0));
-    }
+  void RayCT::SetNumThreads(int n_threads)
+  {
+    num_threads = n_threads;
+  }
 
-    // Set source position
-    double source_angle;
-    Vec3<double> source_position;
-    source_angle = 0.0*(M_PI/180.0);
-    source_position.Set(scanner_radius*cos(source_angle),
-        scanner_radius*sin(source_angle), 0.0);
+  void RayCT::SetProjectionStorage(bool single, std::string file_name)
+  {
+    single_precision_storage = single;
+    projection_file = file_name;
+  }
 
-    // Acquire mean signal at each detector element from source
-    Ray3 source_ray;
-    double gamma, x, y, L, sum;
-    Vec3<double> detector_pos;
+  void RayCT::SetKeepExpectedCounts(bool keep)
+  {
+    keep_expected_counts = keep;
+  }
+
+  void RayCT::SetFloatBackprojection(bool use_float)
+  {
+    float_backprojection = use_float;
+  }
+
+  void RayCT::SetVerbose(bool print)
+  {
+    verbose = print;
+  }
+
+  void RayCT::AcquireAirScan()
+  {
+    // Allocate air scan data (one view)
+    air_scan_data.assign(num_rows*num_channels, 0.0);
+
+    // Source spectrum and air attenuation data
+    const SpectralData &spectral = GetSpectralData();
+    const std::vector<double> &source_spectrum = spectral.spectrum;
+    const std::vector<double> &air_data_table = spectral.mu_air;
+
+    // Acquire mean signal at each detector element from source (at angle 0,
+    // so source to detector vectors are the gantry frame layout)
+    double start_time = omp_get_wtime();
+    double L, sum;
     for(int r = 0; r < num_rows; r++){
       for(int c = 0; c < num_channels; c++){
-        x = scanner_radius*(2.0*cos((M_PI - fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle)) + 1.0);
-        y = 2.0*scanner_radius*sin((M_PI - fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle));
-        detector_pos.x = x*cos(source_angle) - y*sin(source_angle);
-        detector_pos.y = x*sin(source_angle) + y*cos(source_angle);
-        detector_pos.z = 2.0*row_width * (double(r) - (double(num_rows)/2.0) + 0.5);
-        source_ray.SetRay(source_position, detector_pos - source_position);
-        L = source_ray.GetLength();
+        L = sqrt(channel_dx[c]*channel_dx[c] + channel_dy[c]*channel_dy[c] +
+            row_dz[r]*row_dz[r]);
         sum = 0.0;
         for(int e = 0; e < source_spectrum.size(); e++){
           sum += (source_spectrum[e] * exp(-air_data_table[e]*L));
         }
-        air_scan_data.push_back(sum);
+        air_scan_data[num_channels*r + c] = sum;
       }
     }
 
@@ -148,23 +323,21 @@ namespace solutio
       value *= num_photons;
       air_scan_data[n] = value;
     }
-    AddPoissonNoise(air_scan_data);
+    AddStageTime(statistics.acquisition_time, start_time);
+    start_time = omp_get_wtime();
+    AddPoissonNoise(&air_scan_data[0], air_scan_data.size(), air_scan_stream,
+        0);
+    AddStageTime(statistics.noise_time, start_time);
   }
 
   void RayCT::AcquireAxialProjections(ObjectModelXray &M,
       double z)
   {
-    // Clear projection data vector if not empty
-    if(projection_data.size() != 0) projection_data.clear();
-
     // Set source spectrum and attenuation lists
-    std::vector<double> energies;
-    for(int e = 0; e < 151; e++){ energies.push_back(double(e)/1000.0); }
-    std::vector<double> source_spectrum = Tasmip(tube_potential, 0.0,
-        "Aluminum", data_folder);
+    const SpectralData &spectral = GetSpectralData();
     if(!M.IsListTabulated())
     {
-      M.TabulateAttenuationLists(energies, source_spectrum);
+      TabulateModel(M, spectral);
     }
     else
     {
@@ -172,121 +345,689 @@ namespace solutio
     }
 
     // Acquire projection at every angle
-    double a;
-    for(int n = 0; n < proj_per_rotation; n++)
-    {
-      a = (2.0*M_PI*n)/proj_per_rotation;
-      std::cout << "Simulating projection " << (n+1) << " of " << proj_per_rotation << '\n';
-      std::vector<double> proj = ObjectProjection(M, a, z, source_spectrum);
-      for(int p = 0; p < proj.size(); p++)
-      {
-        projection_data.push_back(proj[p]);
-      }
-    }
+    axial_z = z;
+    SimulateViews(M, proj_per_rotation, z, 0.0);
 
     // Scale, add noise, and normalize to air (spatial blurring later)
-    double value;
-    for(int n = 0; n < projection_data.size(); n++)
-    {
-      value = projection_data[n];
-      value *= num_photons;
-      projection_data[n] = value;
-    }
-    AddPoissonNoise(projection_data);
     NormalizeProjections();
   }
 
   void RayCT::AcquireHelicalProjections(ObjectModelXray &M, double pitch,
       double z_start, int n_rotations)
   {
-    // Timing variables
-    time_t start_time, end_time;
-    double projection_calc_time, total_calc_time = 0.0;
-
-	  // Clear projection data vector if not empty
-    if(projection_data.size() != 0) projection_data.clear();
-
     // Set source spectrum and attenuation lists
-    std::vector<double> energies;
-    for(int e = 0; e < 151; e++){ energies.push_back(double(e)/1000.0); }
-    std::vector<double> source_spectrum = Tasmip(tube_potential, 0.0,
-        "Aluminum", data_folder);
+    const SpectralData &spectral = GetSpectralData();
     if(!M.IsListTabulated())
     {
-      M.TabulateAttenuationLists(energies, source_spectrum);
+      TabulateModel(M, spectral);
     }
     else
     {
       std::cout << "Warning: attenuation list already tabulated!\n";
     }
 
-    // Set scan parameters and allocate memory for projection data
-    double angle, z_position;
+    // Set scan parameters
     double table_motion = pitch * row_width * num_rows;
     int total_projections = proj_per_rotation * n_rotations;
 
-    // Main loop over all projection angles
-    for(int n = 0; n < total_projections; n++)
+    // Simulate all projection angles
+    double start_time = omp_get_wtime();
+    bool checkpoints = (checkpoint_file != "" && checkpoint_interval > 0);
+    if(checkpoints && !WriteCheckpointHeader(pitch, z_start, n_rotations))
+    {
+      return;
+    }
+    SimulateViews(M, total_projections, z_start,
+        table_motion/double(proj_per_rotation), 0, checkpoints);
+    if(verbose)
+    {
+      std::cout << "Projection simulation time: " <<
+          (omp_get_wtime() - start_time) << " s\n";
+    }
+
+    // Scale, add noise, and normalize to air (spatial blurring later)
+    NormalizeProjections();
+  }
+
+  void RayCT::SetCheckpoint(std::string file_name, int interval)
+  {
+    checkpoint_file = file_name;
+    checkpoint_interval = interval;
+  }
+
+  // Checkpoint file layout: magic string, version, scan configuration,
+  // simulation settings that change the data (NIST data folder, spectral
+  // compression and transmission table tolerances), random seed, air scan,
+  // number of completed views, then the simulated (not yet normalized) data
+  // of the completed views in double precision. The view data is appended
+  // before the count is updated, so the count never covers data that was
+  // not written.
+  static const char checkpoint_magic[8] = {'R','A','Y','C','T','C','K','P'};
+  static const int checkpoint_version = 2;
+  static const int checkpoint_max_string = 4096;
+
+  template <class T>
+  static void WriteValue(std::fstream &file, const T &value)
+  {
+    file.write((const char *)&value, sizeof(T));
+  }
+
+  template <class T>
+  static void ReadValue(std::fstream &file, T &value)
+  {
+    file.read((char *)&value, sizeof(T));
+  }
+
+  static void WriteString(std::fstream &file, const std::string &text)
+  {
+    int length = text.size();
+    WriteValue(file, length);
+    file.write(text.c_str(), length);
+  }
+
+  // Fails (sets the stream fail bit) for an implausible length
+  static void ReadString(std::fstream &file, std::string &text)
+  {
+    int length = 0;
+    ReadValue(file, length);
+    if(length < 0 || length > checkpoint_max_string)
+    {
+      file.setstate(std::ios::failbit);
+      return;
+    }
+    text.assign(length, ' ');
+    if(length > 0) file.read(&text[0], length);
+  }
+
+  bool RayCT::WriteCheckpointHeader(double pitch, double z_start,
+      int n_rotations)
+  {
+    std::fstream file(checkpoint_file.c_str(),
+        std::ios::out | std::ios::trunc | std::ios::binary);
+    if(!file.is_open())
+    {
+      std::cout << "Error: could not open checkpoint file " <<
+          checkpoint_file << "!\n";
+      return false;
+    }
+    file.write(checkpoint_magic, sizeof(checkpoint_magic));
+    WriteValue(file, checkpoint_version);
+    WriteValue(file, scanner_radius);
+    WriteValue(file, num_channels);
+    WriteValue(file, channel_width);
+    WriteValue(file, num_rows);
+    WriteValue(file, row_width);
+    WriteValue(file, tube_potential);
+    WriteValue(file, filtration);
+    WriteString(file, filter_material);
+    WriteValue(file, num_photons);
+    WriteValue(file, proj_per_rotation);
+    WriteValue(file, pitch);
+    WriteValue(file, z_start);
+    WriteValue(file, n_rotations);
+    WriteString(file, data_folder);
+    WriteValue(file, spectral_tolerance);
+    WriteValue(file, transmission_tolerance);
+    WriteValue(file, random_seed);
+    std::vector<double> air_data(air_scan_data);
+    air_data.resize(size_t(num_rows)*num_channels, 0.0);
+    file.write((const char *)&air_data[0], sizeof(double)*air_data.size());
+    checkpoint_count_offset = file.tellp();
+    long long completed = 0;
+    WriteValue(file, completed);
+    file.close();
+    return !file.fail();
+  }
+
+  bool RayCT::AppendCheckpoint(int view_begin, int view_end)
+  {
+    const size_t view_size = size_t(num_rows)*num_channels;
+    std::fstream file(checkpoint_file.c_str(),
+        std::ios::in | std::ios::out | std::ios::binary);
+    if(!file.is_open())
+    {
+      std::cout << "Error: could not open checkpoint file " <<
+          checkpoint_file << "!\n";
+      return false;
+    }
+    std::vector<double> view_data(view_size);
+    file.seekp(checkpoint_count_offset + sizeof(long long) +
+        sizeof(double)*view_size*view_begin);
+    for(int n = view_begin; n < view_end; n++)
+    {
+      projection_data.ReadView(n, &view_data[0]);
+      file.write((const char *)&view_data[0], sizeof(double)*view_size);
+    }
+    file.flush();
+    long long completed = view_end;
+    file.seekp(checkpoint_count_offset);
+    WriteValue(file, completed);
+    file.close();
+    if(file.fail())
+    {
+      std::cout << "Error: could not write checkpoint file " <<
+          checkpoint_file << "!\n";
+      return false;
+    }
+    return true;
+  }
+
+  bool RayCT::ResumeHelicalProjections(ObjectModelXray &M,
+      std::string file_name)
+  {
+    std::fstream file(file_name.c_str(), std::ios::in | std::ios::binary);
+    char magic[8];
+    int version = 0;
+    file.read(magic, sizeof(magic));
+    ReadValue(file, version);
+    if(!file.is_open() || file.fail() ||
+        !std::equal(magic, magic+8, checkpoint_magic) ||
+        version != checkpoint_version)
     {
-      time(&start_time);
+      std::cout << "Error: " << file_name << " is not a checkpoint file!\n";
+      return false;
+    }
 
-      // Set source angle and z-position
-      angle = (double(n)/double(proj_per_rotation))*2.0*M_PI;
-      while(angle >= (2.0*M_PI)) angle -= (2.0*M_PI);
-      z_position = z_start + (double(n) * (table_motion/double(proj_per_rotation)));
+    // Read scan configuration
+    double radius, d_c, d_r, mm, photons, pitch, z_start;
+    double spectral_error, transmission_error;
+    int n_c, n_r, kVp, projs, n_rotations;
+    std::string material, folder;
+    unsigned long long seed;
+    ReadValue(file, radius);
+    ReadValue(file, n_c);
+    ReadValue(file, d_c);
+    ReadValue(file, n_r);
+    ReadValue(file, d_r);
+    ReadValue(file, kVp);
+    ReadValue(file, mm);
+    ReadString(file, material);
+    ReadValue(file, photons);
+    ReadValue(file, projs);
+    ReadValue(file, pitch);
+    ReadValue(file, z_start);
+    ReadValue(file, n_rotations);
+    ReadString(file, folder);
+    ReadValue(file, spectral_error);
+    ReadValue(file, transmission_error);
+    ReadValue(file, seed);
+    long long header_end = file.tellg();
+    file.seekg(0, std::ios::end);
+    long long data_bytes = (long long)(file.tellg()) - header_end;
+    file.seekg(header_end);
+    if(file.fail() || n_c <= 0 || n_r <= 0 || projs <= 0 ||
+        n_rotations <= 0 || (long long)(projs)*n_rotations > INT_MAX ||
+        (long long)(sizeof(double))*n_r*n_c > data_bytes)
+    {
+      std::cout << "Error: checkpoint file " << file_name <<
+          " has an invalid scan configuration!\n";
+      return false;
+    }
+    const int total_projections = projs * n_rotations;
+    std::vector<double> air_data(size_t(n_r)*n_c);
+    file.read((char *)&air_data[0], sizeof(double)*air_data.size());
+    long count_offset = file.tellg();
+    long long completed = 0;
+    ReadValue(file, completed);
+    if(file.fail())
+    {
+      std::cout << "Error: checkpoint file " << file_name <<
+          " is incomplete!\n";
+      return false;
+    }
+    if(completed < 0 || completed > total_projections)
+    {
+      std::cout << "Error: checkpoint file " << file_name << " has " <<
+          completed << " completed views out of " << total_projections <<
+          "!\n";
+      return false;
+    }
+    // Settings that are not restored must match those of the first run
+    if(folder != data_folder || spectral_error != spectral_tolerance ||
+        transmission_error != transmission_tolerance)
+    {
+      std::cout << "Error: checkpoint file " << file_name << " was made " <<
+          "with different NIST data folder or spectral/transmission " <<
+          "tolerance settings!\n";
+      return false;
+    }
 
-      // Calculate attenuation for each source ray
-      std::cout << "Simulating projection " << (n+1) << " of " << total_projections << "... ";
-      std::vector<double> proj =
-          ObjectProjection(M, angle, z_position, source_spectrum);
-      for(int p = 0; p < proj.size(); p++)
+    // Restore scan configuration
+    checkpoint_count_offset = count_offset;
+    random_seed = seed;
+    SetGeometry(radius, n_c, d_c, n_r, d_r);
+    SetAcquisition(kVp, photons, projs);
+    SetFiltration(mm, material);
+    air_scan_data = air_data;
+    checkpoint_file = file_name;
+    if(checkpoint_interval <= 0) checkpoint_interval = proj_per_rotation;
+
+    // Restore completed views
+    const size_t view_size = size_t(num_rows)*num_channels;
+    WaitForWrites();
+    if(!projection_data.Allocate(total_projections, num_rows, num_channels,
+        single_precision_storage, projection_file))
+    {
+      return false;
+    }
+    std::vector<double> view_data(view_size);
+    for(int n = 0; n < completed; n++)
+    {
+      file.read((char *)&view_data[0], sizeof(double)*view_size);
+      if(file.fail())
       {
-        projection_data.push_back(proj[p]);
+        std::cout << "Error: checkpoint file " << file_name <<
+            " is incomplete!\n";
+        return false;
       }
-
-      time(&end_time);
-      projection_calc_time = difftime(end_time,start_time) / 60.0;
-      total_calc_time += projection_calc_time;
-      std::cout << projection_calc_time << " min., " << total_calc_time << " min. total\n";
+      projection_data.WriteView(n, &view_data[0]);
+    }
+    file.close();
+    if(verbose)
+    {
+      std::cout << "Resuming helical acquisition at projection " <<
+          (completed+1) << " of " << total_projections << '\n';
     }
 
+    const SpectralData &spectral = GetSpectralData();
+    if(!M.IsListTabulated()) TabulateModel(M, spectral);
+    double table_motion = pitch * row_width * num_rows;
+    SimulateViews(M, total_projections, z_start,
+        table_motion/double(proj_per_rotation), int(completed), true);
+
     // Scale, add noise, and normalize to air (spatial blurring later)
-    double value;
-    for(int n = 0; n < projection_data.size(); n++)
+    NormalizeProjections();
+    return true;
+  }
+
+  void RayCT::AcquireAxialPathlengths(ObjectModelXray &M, double z)
+  {
+    axial_z = z;
+    TracePathlengths(M, proj_per_rotation, z, 0.0);
+  }
+
+  void RayCT::AcquireHelicalPathlengths(ObjectModelXray &M, double pitch,
+      double z_start, int n_rotations)
+  {
+    double table_motion = pitch * row_width * num_rows;
+    TracePathlengths(M, proj_per_rotation * n_rotations, z_start,
+        table_motion/double(proj_per_rotation));
+  }
+
+  // Make projection data from the stored path lengths with the current
+  // spectrum; the attenuation lists of the model are retabulated
+  void RayCT::ApplySpectrum(ObjectModelXray &M)
+  {
+    RayTraceWork work;
+    M.InitRayTraceWork(work);
+    const int num_materials = work.material_lengths.size();
+    if(pathlength_views == 0 || num_materials != pathlength_model_materials)
     {
-      value = projection_data[n];
-      value *= num_photons;
-      projection_data[n] = value;
+      std::cout << "Error: no path length data for this model!\n";
+      return;
+    }
+    if(pathlength_radius != scanner_radius ||
+        pathlength_channels != num_channels ||
+        pathlength_channel_width != channel_width ||
+        pathlength_rows != num_rows || pathlength_row_width != row_width ||
+        pathlength_proj_per_rotation != proj_per_rotation)
+    {
+      std::cout << "Error: scanner geometry changed since the path lengths " <<
+          "were traced!\n";
+      return;
+    }
+    const SpectralData &spectral = GetSpectralData();
+    TabulateModel(M, spectral);
+
+    const int view_size = num_rows*num_channels;
+    WaitForWrites();
+    if(!projection_data.Allocate(pathlength_views, num_rows, num_channels,
+        single_precision_storage, projection_file))
+    {
+      return;
+    }
+    const int num_stored = pathlength_materials.size();
+    const int * stored = pathlength_materials.data();
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    double start_time = omp_get_wtime();
+    #pragma omp parallel num_threads(threads)
+    {
+      std::vector<double> lengths(num_materials, 0.0);
+      std::vector<double> view_data(view_size);
+      #pragma omp for schedule(static)
+      for(int n = 0; n < pathlength_views; n++)
+      {
+        const float * L = &pathlength_data[size_t(num_stored)*view_size*n];
+        for(int p = 0; p < view_size; p++)
+        {
+          for(int m = 0; m < num_stored; m++)
+          {
+            lengths[stored[m]] = L[num_stored*p + m];
+          }
+          view_data[p] = M.SpectralTransmission(&lengths[0]);
+        }
+        projection_data.WriteView(n, &view_data[0]);
+      }
     }
-    AddPoissonNoise(projection_data);
+    AddStageTime(statistics.acquisition_time, start_time);
+
+    // Scale, add noise, and normalize to air (spatial blurring later)
     NormalizeProjections();
   }
 
-  void RayCT::ReconAxialFBP()
+  void RayCT::SetRandomSeed(unsigned long long seed)
   {
-    // Timing variables
-    time_t start_time, end_time;
-    double time_pre, time_lookup, time_wbp;
-    time(&start_time);
+    random_seed = seed;
+  }
 
-    // Set source spectrum
-    std::vector<double> energies;
-    for(int e = 0; e < 151; e++){ energies.push_back(double(e)); }
-    std::vector<double> source_spectrum = Tasmip(tube_potential, 0.0,
-        "Aluminum", data_folder);
+  void RayCT::GenerateNoiseRealizations(int n_realizations,
+      std::function<void(int)> callback)
+  {
+    const size_t num_views = expected_counts.NumViews();
+    const int view_size = num_rows*num_channels;
+    if(num_views == 0)
+    {
+      std::cout << "Error: no expected counts for noise realizations "
+          << "(see SetKeepExpectedCounts)!\n";
+      return;
+    }
+    WaitForWrites();
+    if(projection_data.NumViews() != num_views)
+    {
+      if(!projection_data.Allocate(num_views, num_rows, num_channels,
+          single_precision_storage, projection_file))
+      {
+        return;
+      }
+    }
 
-    // Get mean attenuation coefficients for air and water
-    NistPad NistAir(data_folder, "Air");
-    NistPad NistWater(data_folder, "Water");
-    double mean_energy = 0.0, mu_air, mu_water;
-    for(int e = 0; e < 151; e++) mean_energy += source_spectrum[e]*double(e);
-    mean_energy /= 1000.0;
-    mu_air = NistAir.LinearAttenuation(mean_energy);
-    mu_water = NistWater.LinearAttenuation(mean_energy);
-    std::cout << mean_energy << '\t' << mu_air << '\t' << mu_water << '\n';
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    for(int k = 0; k < n_realizations; k++)
+    {
+      // A background write started by the previous callback still reads
+      // the projection data
+      WaitForWrites();
+      double start_time = omp_get_wtime();
+      // Each view has its own generator, seeded from (seed, realization,
+      // view), so views can be processed in any order
+      #pragma omp parallel num_threads(threads)
+      {
+        std::vector<double> view_data(view_size);
+        #pragma omp for schedule(static)
+        for(long n = 0; n < long(num_views); n++)
+        {
+          expected_counts.ReadView(n, &view_data[0]);
+          AddPoissonNoise(&view_data[0], view_size, k, n);
+          for(int p = 0; p < view_size; p++)
+          {
+            view_data[p] = log(air_scan_data[p] / view_data[p]);
+          }
+          projection_data.WriteView(n, &view_data[0]);
+        }
+      }
+      AddStageTime(statistics.noise_time, start_time);
+      callback(k);
+    }
+  }
+
+  void RayCT::StreamAxialFBP(ObjectModelXray &M, double z, int window)
+  {
+    const SpectralData &spectral = GetSpectralData();
+    if(!M.IsListTabulated()) TabulateModel(M, spectral);
+    axial_z = z;
+
+    // Ray tracing scratch buffers, one set per simulation thread; about half
+    // of the threads simulate, the rest filter and backproject
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    int source_threads = std::max(1, threads/2);
+    std::vector<RayTraceWork> work(source_threads);
+    for(int t = 0; t < source_threads; t++) M.InitRayTraceWork(work[t]);
+    StreamFBP([&](int thread, int n, double view[])
+        {
+          double angle = (2.0*M_PI*double(n)) / double(proj_per_rotation);
+          ObjectProjection(M, angle, z, work[thread], view);
+        }, source_threads, true, window);
+  }
+
+  void RayCT::StreamAxialFBP(int window)
+  {
+    if(projection_data.NumViews() < proj_per_rotation)
+    {
+      std::cout << "Error: no axial projection data to reconstruct!\n";
+      return;
+    }
+    WaitForWrites();
+    StreamFBP([&](int /*thread*/, int n, double view[])
+        {
+          projection_data.ReadView(n, view);
+        }, 1, false, window);
+  }
+
+  // One view of raw or normalized detector data
+  struct StreamView
+  {
+    int view;
+    std::vector<double> data;
+  };
+
+  // Consecutive row-averaged views, ready for backprojection
+  struct StreamBatch
+  {
+    int first_view;
+    int num_views;
+    std::vector<double> data;
+  };
+
+  // Pipeline for streaming FBP of one rotation. Source threads produce
+  // views (in any order) into the first queue; the processing thread puts
+  // them back in order, and normalizes (if raw), averages rows, applies
+  // beam hardening correction, fan-beam weighting and filtering to batches
+  // of consecutive views; this thread backprojects each batch. A source
+  // waits before producing a view more than window views ahead of the next
+  // one in order, so at most window views are held for reordering. Threads
+  // left over from the sources and the processing thread backproject.
+  void RayCT::StreamFBP(std::function<void(int, int, double[])> source,
+      int source_threads, bool normalize, int window)
+  {
+    double start_time = omp_get_wtime();
+    const int view_size = num_rows*num_channels;
+    const int batch_size = 16;
+    if(normalize && air_scan_data.size() != view_size)
+    {
+      std::cout << "Error: air scan needed for streaming acquisition!\n";
+      return;
+    }
+
+    // Attenuation coefficients for CT #'s
+    const SpectralData &spectral = GetSpectralData();
+    double mu_air = spectral.mean_mu_air;
+    double mu_water = spectral.mean_mu_water;
+
+    // Angle gamma and fan-beam weight for a row of projection data
+    std::vector<double> p_gamma(num_channels), fan_weight(num_channels);
+    for(int c = 0; c < num_channels; c++)
+    {
+      p_gamma[c] = (-fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle);
+      fan_weight[c] = scanner_radius*cos(p_gamma[c]);
+    }
+    BackprojectionLookups lookups;
+    CalcLookups(lookups);
+    std::vector<double> image_sum(size_t(matrix_size)*matrix_size, 0.0);
+
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    int backproject_threads = std::max(1, threads - source_threads - 1);
+    window = std::max(1, window);
+    BoundedQueue<StreamView> acquired(window);
+    BoundedQueue<StreamBatch> processed(std::max(1, window/batch_size));
+
+    // First view not yet taken in order by the processing thread
+    int ordered_view = 0;
+    std::mutex order_mutex;
+    std::condition_variable order_changed;
+
+    // Stage 1: acquire views (the stage is timed from the start of the
+    // sources to the end of the last one)
+    double source_start = omp_get_wtime();
+    double source_end = source_start;
+    std::atomic<int> next_view(0);
+    std::atomic<int> active_sources(source_threads);
+    std::vector<std::thread> sources;
+    for(int t = 0; t < source_threads; t++)
+    {
+      sources.push_back(std::thread([&, t]()
+          {
+            for(int n = next_view++; n < proj_per_rotation; n = next_view++)
+            {
+              {
+                std::unique_lock<std::mutex> lock(order_mutex);
+                order_changed.wait(lock,
+                    [&]{ return n < ordered_view + window; });
+              }
+              StreamView item;
+              item.view = n;
+              item.data.resize(view_size);
+              source(t, n, &item.data[0]);
+              if(!acquired.Push(std::move(item))) break;
+            }
+            if(--active_sources == 0)
+            {
+              source_end = omp_get_wtime();
+              acquired.Close();
+            }
+          }));
+    }
+
+    // Stage 2: normalize, average rows, correct and filter
+    std::thread processor([&]()
+        {
+          std::map<int, std::vector<double> > pending;
+          StreamBatch batch;
+          batch.first_view = 0;
+          batch.num_views = 0;
+          batch.data.assign(size_t(batch_size)*num_channels, 0.0);
+          int next = 0;
+          double noise_time = 0.0, normalization_time = 0.0;
+          StreamView item;
+          while(acquired.Pop(item))
+          {
+            pending[item.view].swap(item.data);
+            std::map<int, std::vector<double> >::iterator it;
+            while((it = pending.find(next)) != pending.end())
+            {
+              double * view = &(it->second)[0];
+              if(normalize)
+              {
+                double stage_start = omp_get_wtime();
+                for(int p = 0; p < view_size; p++) view[p] *= num_photons;
+                AddPoissonNoise(view, view_size, acquisition_stream, next);
+                double stage_end = omp_get_wtime();
+                noise_time += stage_end - stage_start;
+                for(int p = 0; p < view_size; p++)
+                {
+                  view[p] = log(air_scan_data[p] / view[p]);
+                }
+                normalization_time += omp_get_wtime() - stage_end;
+              }
+              double * row = &batch.data[size_t(num_channels)*batch.num_views];
+              for(int c = 0; c < num_channels; c++)
+              {
+                double sum = 0.0;
+                for(int r = 0; r < num_rows; r++) sum += view[num_channels*r+c];
+                row[c] = sum / double(num_rows);
+              }
+              pending.erase(it);
+              next++;
+              {
+                std::lock_guard<std::mutex> lock(order_mutex);
+                ordered_view = next;
+              }
+              order_changed.notify_all();
+              batch.num_views++;
+              if(batch.num_views < batch_size && next < proj_per_rotation)
+              {
+                continue;
+              }
+              // Batch is full (a last partial batch is padded with zeros)
+              TissueBHC(spectral, &batch.data[0], batch_size, 1);
+              for(int n = 0; n < batch.num_views; n++)
+              {
+                for(int c = 0; c < num_channels; c++)
+                {
+                  batch.data[size_t(num_channels)*n+c] *= fan_weight[c];
+                }
+              }
+              FilterProjections1D(&batch.data[0], batch_size, 0.0, 1);
+              processed.Push(batch);
+              batch.first_view = next;
+              batch.num_views = 0;
+              batch.data.assign(size_t(batch_size)*num_channels, 0.0);
+            }
+          }
+          AddStageDuration(statistics.noise_time, noise_time);
+          AddStageDuration(statistics.normalization_time, normalization_time);
+          processed.Close();
+        });
+
+    // Stage 3: backproject (and keep the filtered views for ROI recon)
+    StreamBatch batch;
+    long out_of_range = 0;
+    filtered_projections.assign(size_t(num_channels)*proj_per_rotation, 0.0);
+    while(processed.Pop(batch))
+    {
+      out_of_range += BackprojectViews(&batch.data[0], lookups, &p_gamma[0],
+          batch.first_view, batch.first_view + batch.num_views,
+          &image_sum[0], backproject_threads);
+      std::copy(batch.data.begin(),
+          batch.data.begin() + size_t(num_channels)*batch.num_views,
+          filtered_projections.begin() + size_t(num_channels)*batch.first_view);
+    }
+    filtered_mu_water = mu_water;
+    filtered_mu_air = mu_air;
+    for(int t = 0; t < source_threads; t++) sources[t].join();
+    processor.join();
+    // Raw views are simulated, so the source stage is the acquisition
+    if(normalize)
+    {
+      AddStageDuration(statistics.acquisition_time,
+          source_end - source_start);
+    }
+    if(out_of_range > 0)
+    {
+      std::cout << "Warning: gamma outside of projection data range for " <<
+          out_of_range << " pixel/view samples!\n";
+    }
+
+    size_t image_offset = image_data.size();
+    image_data.resize(image_offset + size_t(matrix_size)*matrix_size);
+    ConvertToHU(&image_sum[0], lookups, mu_water, mu_air,
+        &image_data[image_offset]);
+    slice_spacing = num_rows*row_width;
+    if(verbose)
+    {
+      std::cout << "Streaming FBP time: " << (omp_get_wtime()-start_time) <<
+          " s\n";
+    }
+  }
+
+  void RayCT::ReconAxialFBP()
+  {
+    // Timing variables
+    double start_time, time_pre, time_lookup, time_wbp;
+    start_time = omp_get_wtime();
+
+    // Get mean beam energy and attenuation coefficients for air and water
+    const SpectralData &spectral = GetSpectralData();
+    double mean_energy = spectral.mean_energy;
+    double mu_air = spectral.mean_mu_air;
+    double mu_water = spectral.mean_mu_water;
+    if(verbose)
+    {
+      std::cout << mean_energy << '\t' << mu_air << '\t' << mu_water << '\n';
+    }
 
     // Select axial data for reconstruction
-    double spatial_proj[(const int)(num_channels*proj_per_rotation)];
+    std::vector<double> spatial_proj_data(size_t(num_channels)*proj_per_rotation);
+    double * spatial_proj = &spatial_proj_data[0];
     for(int n = 0; n < proj_per_rotation; n++)
     {
       for(int c = 0; c < num_channels; c++)
@@ -302,7 +1043,7 @@ namespace solutio
     }
 
     // Beam hardening correction, step 1 (soft tissue only)
-    TissueBHC(source_spectrum, spatial_proj, mean_energy);
+    TissueBHC(spectral, spatial_proj, proj_per_rotation);
 
     // Angle gamma for a row of projection data
     double p_gamma[(const int)(num_channels)];
@@ -320,56 +1061,575 @@ namespace solutio
     }
 
     // Filter projection data
-    std::cout << "Filtering projection data for slice...\n";
-    FilterProjections1D(spatial_proj);
-
-    time(&end_time);
-    time_pre = difftime(end_time, start_time) / 60;
-
-    // Weighted backprojection
-    int num_images = 1;
+    if(verbose) std::cout << "Filtering projection data for slice...\n";
+    FilterProjections1D(spatial_proj, proj_per_rotation);
+    filtered_projections = spatial_proj_data;
+    filtered_mu_water = mu_water;
+    filtered_mu_air = mu_air;
+    time_pre = omp_get_wtime() - start_time;
 
     // Calculate lookup tables
-    time(&start_time);
-    std::cout << "Calculating backprojection lookup tables...\n";
-    double xy_table[(const int)(matrix_size)];
-    double * L = new double [matrix_size*matrix_size*proj_per_rotation];
-    double * gamma = new double [matrix_size*matrix_size*proj_per_rotation];
-    double pixel_dim = CalcLookups(xy_table, L, gamma);
-    time(&end_time);
-    time_lookup = difftime(end_time, start_time) / 60;
+    start_time = omp_get_wtime();
+    if(verbose) std::cout << "Calculating backprojection lookup tables...\n";
+    BackprojectionLookups lookups;
+    CalcLookups(lookups);
+    slice_spacing = num_rows*row_width;
+    time_lookup = omp_get_wtime() - start_time;
 
     // Perform backprojection
-    time(&start_time);
-    std::cout << "Performing weighted backprojection...\n";
-    std::vector<int> slice = WeightedBackprojection(spatial_proj, xy_table,
-        L, gamma, p_gamma, mu_water, mu_air);
-    for(int p = 0; p < (matrix_size*matrix_size); p++)
+    start_time = omp_get_wtime();
+    if(verbose) std::cout << "Performing weighted backprojection...\n";
+    size_t image_offset = image_data.size();
+    image_data.resize(image_offset + size_t(matrix_size)*matrix_size);
+    WeightedBackprojection(spatial_proj, lookups, p_gamma, mu_water, mu_air,
+        &image_data[image_offset]);
+    time_wbp = omp_get_wtime() - start_time;
+
+    if(verbose)
     {
-      image_data.push_back(slice[p]);
+      std::cout.precision(3);
+      std::cout << "Projection processing/filtering time: " << time_pre <<
+          " s\n";
+      std::cout << "Lookup table calculation time: " << time_lookup << " s\n";
+      std::cout << "Weighted backprojection time: " << time_wbp << " s\n";
+      std::cout << "Total time: " << (time_pre+time_lookup+time_wbp) << " s\n";
     }
-    time(&end_time);
-    time_wbp = difftime(end_time, start_time) / 60;
-
-    std::cout.precision(3);
-    std::cout << "Projection processing/filtering time: " << time_pre << " min.\n";
-    std::cout << "Lookup table calculation time: " << time_lookup << " min.\n";
-    std::cout << "Weighted backprojection time: " << time_wbp << " min.\n";
-    std::cout << "Total time: " << (time_pre+time_lookup+time_wbp) << " min.\n";
-
-    delete [] L;
-    delete [] gamma;
   }
 
-  // Reconstruct helically acquired fan beam images FBP and linear interpolation
-  void RayCT::HelicalFIFBP(double pitch, double z_start, int n_rotations)
+  // Backproject the stored filtered sinogram over the ROI pixels only. The
+  // filtered data and geometry are only read, so this is thread-safe.
+  bool RayCT::ReconAxialROI(ImageROI &roi, int n_threads)
   {
+    if(!CheckROI(roi)) return false;
+    BackprojectionLookups lookups;
+    CalcROILookups(lookups, roi);
+    BackprojectROI(roi, lookups, n_threads, true);
+    return true;
+  }
+
+  // Lookups are made for every ROI first, then the ROIs are backprojected
+  // concurrently; the backprojection stage is timed once for all of them
+  bool RayCT::ReconAxialROIs(std::vector<ImageROI> &rois)
+  {
+    bool success = true;
+    std::vector<BackprojectionLookups> lookups(rois.size());
+    std::vector<int> valid;
+    for(size_t n = 0; n < rois.size(); n++)
+    {
+      if(!CheckROI(rois[n]))
+      {
+        success = false;
+        continue;
+      }
+      CalcROILookups(lookups[n], rois[n]);
+      valid.push_back(n);
+    }
+
+    // Each ROI's backprojection is itself threaded, so split the threads
+    // between ROIs
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    int concurrent = std::max(1, std::min(int(valid.size()), threads));
+    int roi_threads = std::max(1, threads / concurrent);
+    double start_time = omp_get_wtime();
+    std::atomic<int> next_roi(0);
+    std::vector< std::future<void> > workers;
+    for(int t = 0; t < concurrent; t++)
+    {
+      workers.push_back(std::async(std::launch::async, [&]()
+          {
+            for(int k = next_roi++; k < int(valid.size()); k = next_roi++)
+            {
+              BackprojectROI(rois[valid[k]], lookups[valid[k]], roi_threads,
+                  false);
+            }
+          }));
+    }
+    for(int t = 0; t < concurrent; t++) workers[t].get();
+    AddStageTime(statistics.backprojection_time, start_time);
+    return success;
+  }
+
+  bool RayCT::CheckROI(const ImageROI &roi)
+  {
+    if(filtered_projections.size() !=
+        size_t(num_channels)*proj_per_rotation)
+    {
+      std::cout << "Error: no filtered projections for ROI recon!\n";
+      return false;
+    }
+    if(roi.pixel_size <= 0.0 || roi.width <= 0.0 || roi.height <= 0.0)
+    {
+      std::cout << "Error: ROI size and pixel size must be positive!\n";
+      return false;
+    }
+    return true;
+  }
 
+  void RayCT::BackprojectROI(ImageROI &roi,
+      const BackprojectionLookups &lookups, int n_threads, bool timed)
+  {
+    std::vector<double> p_gamma(num_channels);
+    for(int c = 0; c < num_channels; c++)
+    {
+      p_gamma[c] = (-fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle);
+    }
+    roi.image.resize(size_t(roi.x_size)*roi.y_size);
+    WeightedBackprojection(&filtered_projections[0], lookups, &p_gamma[0],
+        filtered_mu_water, filtered_mu_air, &roi.image[0], n_threads, timed);
+  }
+
+  // Axial FBP after rebinning the fan-beam data to parallel beams. Parallel
+  // view k has ray direction angle theta = 2*pi*k/N and detector offset t;
+  // it is interpolated from the fan-beam view beta = theta - gamma at fan
+  // angle gamma = asin(t/R). The shift theta - beta is the same for every
+  // view, so the rebinning weights depend on the channel only.
+  void RayCT::ReconAxialParallelFBP()
+  {
+    double start_time = omp_get_wtime();
+
+    // Attenuation coefficients for air and water at the mean energy
+    const SpectralData &spectral = GetSpectralData();
+    double mu_air = spectral.mean_mu_air;
+    double mu_water = spectral.mean_mu_water;
+
+    // Select axial data for reconstruction (average of detector rows)
+    std::vector<double> fan_proj(size_t(num_channels)*proj_per_rotation);
+    for(int n = 0; n < proj_per_rotation; n++)
+    {
+      for(int c = 0; c < num_channels; c++)
+      {
+        double sum = 0.0;
+        for(int r = 0; r < num_rows; r++)
+        {
+          sum += projection_data[(size_t(num_rows)*num_channels*n +
+              num_channels*r + c)];
+        }
+        fan_proj[(num_channels*n+c)] = sum / double(num_rows);
+      }
+    }
+
+    // Beam hardening correction, step 1 (soft tissue only)
+    TissueBHC(spectral, &fan_proj[0], proj_per_rotation);
+
+    // Rebinning weights: parallel detector positions have the central fan
+    // beam spacing, and positions outside the fan are set to zero
+    const double d_beta = (2.0*M_PI) / double(proj_per_rotation);
+    const double dt = scanner_radius*d_fan_angle;
+    const double t_min = -0.5*double(num_channels-1)*dt;
+    const double gamma_first = -fan_angle/2.0 + d_fan_angle/2.0;
+    const double gamma_max = fan_angle/2.0 - d_fan_angle/2.0;
+    std::vector<int> view_shift(num_channels), channel(num_channels);
+    std::vector<double> view_f(num_channels), channel_f(num_channels);
+    std::vector<char> valid(num_channels);
+    for(int c = 0; c < num_channels; c++)
+    {
+      double t = t_min + c*dt;
+      valid[c] = (fabs(t) <= scanner_radius*sin(gamma_max));
+      double gamma = valid[c] ? asin(t/scanner_radius) : 0.0;
+      // Fan view index b = k - gamma/d_beta, split into integer and fraction
+      double shift = gamma / d_beta;
+      view_shift[c] = int(floor(shift));
+      view_f[c] = shift - floor(shift);
+      double multiple = (gamma - gamma_first) / d_fan_angle;
+      multiple = std::min(std::max(multiple, 0.0), double(num_channels - 1));
+      channel[c] = std::min(int(multiple), num_channels - 2);
+      channel_f[c] = multiple - double(channel[c]);
+    }
+    std::vector<double> par_proj(size_t(num_channels)*proj_per_rotation);
+    const int N = proj_per_rotation;
+    #pragma omp parallel for
+    for(int k = 0; k < N; k++)
+    {
+      for(int c = 0; c < num_channels; c++)
+      {
+        if(!valid[c])
+        {
+          par_proj[size_t(num_channels)*k + c] = 0.0;
+          continue;
+        }
+        // Views k - shift (fraction 1 - view_f) and k - shift - 1 (view_f)
+        int b0 = ((k - view_shift[c]) % N + N) % N;
+        int b1 = (b0 - 1 + N) % N;
+        const double * p0 = &fan_proj[size_t(num_channels)*b0 + channel[c]];
+        const double * p1 = &fan_proj[size_t(num_channels)*b1 + channel[c]];
+        double v0 = (1.0-channel_f[c])*p0[0] + channel_f[c]*p0[1];
+        double v1 = (1.0-channel_f[c])*p1[0] + channel_f[c]*p1[1];
+        par_proj[size_t(num_channels)*k + c] =
+            (1.0-view_f[c])*v0 + view_f[c]*v1;
+      }
+    }
+
+    // Filter and backproject
+    FilterProjections1D(&par_proj[0], proj_per_rotation, dt);
+    BackprojectionLookups lookups;
+    CalcLookups(lookups);
+    std::vector<double> image_sum(size_t(matrix_size)*matrix_size, 0.0);
+    BackprojectParallelViews(&par_proj[0], lookups, t_min, dt, &image_sum[0]);
+    size_t image_offset = image_data.size();
+    image_data.resize(image_offset + size_t(matrix_size)*matrix_size);
+    ConvertToHU(&image_sum[0], lookups, mu_water, mu_air,
+        &image_data[image_offset]);
+    slice_spacing = num_rows*row_width;
+
+    if(verbose)
+    {
+      std::cout << "Parallel-beam FBP time: " <<
+          (omp_get_wtime()-start_time) << " s\n";
+    }
+  }
+
+  // Reconstruct a slab of axial images (one per detector row) from a
+  // multi-row axial acquisition with the FDK cone-beam algorithm
+  ItkImageF3::Pointer RayCT::ReconAxialFDK()
+  {
+    if(projection_data.NumViews() < size_t(proj_per_rotation))
+    {
+      std::cout << "Error: no axial projection data to reconstruct!\n";
+      return ItkImageF3::Pointer();
+    }
+    if(num_rows < 2)
+    {
+      std::cout << "Error: cone-beam recon needs more than one detector " <<
+          "row!\n";
+      return ItkImageF3::Pointer();
+    }
+
+    // Timing variables
+    double start_time, time_pre, time_bp;
+    start_time = omp_get_wtime();
+
+    // Get attenuation coefficients for air and water at the mean energy
+    const SpectralData &spectral = GetSpectralData();
+    double mu_air = spectral.mean_mu_air;
+    double mu_water = spectral.mean_mu_water;
+
+    // Copy one rotation of projection data; each detector row of each view
+    // is filtered as a separate fan-beam projection
+    const int num_lines = proj_per_rotation*num_rows;
+    std::vector<double> cone_proj(size_t(num_lines)*num_channels);
+    for(int n = 0; n < proj_per_rotation; n++)
+    {
+      projection_data.ReadView(n, &cone_proj[size_t(num_rows)*num_channels*n]);
+    }
+
+    // Beam hardening correction, step 1 (soft tissue only)
+    TissueBHC(spectral, &cone_proj[0], num_lines);
+
+    // Angle gamma for a row of projection data
+    std::vector<double> p_gamma(num_channels);
+    for(int c = 0; c < num_channels; c++)
+    {
+      p_gamma[c] = (-fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle);
+    }
+    // Cosine pre-weighting: fan angle and cone angle (row height at
+    // isocenter relative to source distance)
+    #pragma omp parallel for
+    for(int l = 0; l < num_lines; l++)
+    {
+      double zeta = row_width*(double(l % num_rows) -
+          (double(num_rows)/2.0) + 0.5);
+      double cone_weight = scanner_radius /
+          sqrt(scanner_radius*scanner_radius + zeta*zeta);
+      for(int c = 0; c < num_channels; c++)
+      {
+        cone_proj[(size_t(num_channels)*l+c)] *=
+            (scanner_radius*cos(p_gamma[c])*cone_weight);
+      }
+    }
+
+    // Filter projection data
+    if(verbose) std::cout << "Filtering cone-beam projection data...\n";
+    FilterProjections1D(&cone_proj[0], num_lines);
+    time_pre = omp_get_wtime() - start_time;
+
+    // Voxel-driven backprojection; slices are centered on the detector rows
+    // (as projected to isocenter)
+    start_time = omp_get_wtime();
+    if(verbose) std::cout << "Performing cone-beam backprojection...\n";
+    BackprojectionLookups lookups;
+    CalcLookups(lookups);
+    std::vector<double> slice_dz(num_rows);
+    for(int k = 0; k < num_rows; k++)
+    {
+      slice_dz[k] = row_width*(double(k) - (double(num_rows)/2.0) + 0.5);
+    }
+    const size_t slice_size = size_t(matrix_size)*matrix_size;
+    std::vector<double> volume_sum(slice_size*num_rows, 0.0);
+    long out_of_range = BackprojectConeViews(&cone_proj[0], lookups,
+        &p_gamma[0], slice_dz, &volume_sum[0]);
+    if(out_of_range > 0)
+    {
+      std::cout << "Warning: gamma outside of projection data range for " <<
+          out_of_range << " pixel/view samples!\n";
+    }
+
+    // Convert to HU; store in image data and in ITK volume
+    using ImageType = ItkImageF3;
+    ImageType::Pointer volume = ImageType::New();
+    ImageType::IndexType start;
+    start.Fill(0);
+    ImageType::SizeType size;
+    size[0] = matrix_size;
+    size[1] = matrix_size;
+    size[2] = num_rows;
+    ImageType::RegionType region;
+    region.SetIndex(start);
+    region.SetSize(size);
+    volume->SetRegions(region);
+    volume->Allocate();
+    double spacing[3], origin[3];
+    spacing[0] = 10.0*lookups.pixel_dim;
+    spacing[1] = 10.0*lookups.pixel_dim;
+    spacing[2] = 10.0*row_width;
+    origin[0] = 10.0*lookups.x[0];
+    origin[1] = 10.0*lookups.y[0];
+    origin[2] = 10.0*(axial_z + slice_dz[0]);
+    volume->SetSpacing(spacing);
+    volume->SetOrigin(origin);
+    float * voxels = volume->GetBufferPointer();
+
+    size_t image_offset = image_data.size();
+    image_data.resize(image_offset + slice_size*num_rows);
+    const double d_angle = (2.0*M_PI) / double(proj_per_rotation);
+    #pragma omp parallel for
+    for(int k = 0; k < num_rows; k++)
+    {
+      for(int i = 0; i < matrix_size; i++)
+      {
+        for(int j = 0; j < matrix_size; j++)
+        {
+          size_t p = size_t(matrix_size)*i + j;
+          int hu = -1000;
+          if(lookups.in_fov[p])
+          {
+            double sum = volume_sum[slice_size*k + p] * d_angle;
+            hu = round(1000*((sum-mu_water)/(mu_water-mu_air)));
+          }
+          image_data[image_offset + slice_size*k + p] = hu;
+          // ITK voxel order is x fastest (image index i is x)
+          voxels[slice_size*k + size_t(matrix_size)*j + i] = float(hu);
+        }
+      }
+    }
+    slice_spacing = row_width;
+    time_bp = omp_get_wtime() - start_time;
+
+    if(verbose)
+    {
+      std::cout.precision(3);
+      std::cout << "Projection processing/filtering time: " << time_pre <<
+          " s\n";
+      std::cout << "Cone-beam backprojection time: " << time_bp << " s\n";
+      std::cout << "Total time: " << (time_pre+time_bp) << " s\n";
+    }
+    return volume;
+  }
+
+  // Iterative reconstruction of the axial scan with ordered subsets SART.
+  // Views are split into n_subsets interleaved subsets; for each subset, the
+  // current image is forward projected, and the ray-normalized residual is
+  // backprojected and normalized by the number of contributing views. A
+  // warm start uses the previous iterative image or, failing that, the last
+  // reconstructed slice (e.g. from ReconAxialFBP). Iterations stop early when
+  // the relative decrease of the residual norm falls below tolerance.
+  // The projector pair is not matched: the forward projector is ray-driven
+  // (bilinear samples along the ray) and the backprojector is pixel-driven
+  // (unweighted channel interpolation), which is not its exact transpose.
+  // The iterations then settle near, not exactly at, a least squares
+  // solution, and the residual levels off at a small value instead of
+  // going to zero; use relaxation <= 1 and the tolerance stop.
+  void RayCT::ReconAxialOSSART(int n_iterations, int n_subsets,
+      double relaxation, double tolerance, bool warm_start)
+  {
+    double start_time = omp_get_wtime();
+
+    // Get attenuation coefficients for air and water at the mean energy
+    const SpectralData &spectral = GetSpectralData();
+    double mu_air = spectral.mean_mu_air;
+    double mu_water = spectral.mean_mu_water;
+
+    // Select axial data for reconstruction (average of detector rows)
+    std::vector<double> proj(size_t(num_channels)*proj_per_rotation);
+    for(int n = 0; n < proj_per_rotation; n++)
+    {
+      for(int c = 0; c < num_channels; c++)
+      {
+        double sum = 0.0;
+        for(int r = 0; r < num_rows; r++)
+        {
+          sum += projection_data[(size_t(num_rows)*num_channels*n +
+              num_channels*r + c)];
+        }
+        proj[(num_channels*n+c)] = sum / double(num_rows);
+      }
+    }
+
+    // Beam hardening correction, step 1 (soft tissue only)
+    TissueBHC(spectral, &proj[0], proj_per_rotation);
+
+    // Angle gamma for a row of projection data
+    std::vector<double> p_gamma(num_channels);
+    for(int c = 0; c < num_channels; c++)
+    {
+      p_gamma[c] = (-fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle);
+    }
+
+    // Image geometry
+    BackprojectionLookups lookups;
+    CalcLookups(lookups);
+    const size_t num_pixels = size_t(matrix_size)*matrix_size;
+
+    // Initial image (attenuation coefficients)
+    if(warm_start && iterative_image.size() == num_pixels)
+    {
+      if(verbose) std::cout << "Warm start from previous iterative image\n";
+    }
+    else if(warm_start && image_data.size() >= num_pixels)
+    {
+      if(verbose) std::cout << "Warm start from last reconstructed image\n";
+      iterative_image.resize(num_pixels);
+      const int * last = &image_data[image_data.size() - num_pixels];
+      for(size_t p = 0; p < num_pixels; p++)
+      {
+        double mu = mu_water + (double(last[p])/1000.0)*(mu_water - mu_air);
+        iterative_image[p] = lookups.in_fov[p] ? std::max(mu, 0.0) : 0.0;
+      }
+    }
+    else iterative_image.assign(num_pixels, 0.0);
+
+    // Ordered subsets (bit-reversed order, so that consecutive subsets are
+    // far apart in angle)
+    n_subsets = std::max(1, std::min(n_subsets, proj_per_rotation));
+    int subset_bits = 0;
+    while((1 << subset_bits) < n_subsets) subset_bits++;
+    std::vector<int> subset_order;
+    for(int k = 0; k < (1 << subset_bits); k++)
+    {
+      int reversed = 0;
+      for(int b = 0; b < subset_bits; b++)
+      {
+        if(k & (1 << b)) reversed |= (1 << (subset_bits - 1 - b));
+      }
+      if(reversed < n_subsets) subset_order.push_back(reversed);
+    }
+    std::vector< std::vector<int> > subset_views(n_subsets);
+    for(int a = 0; a < proj_per_rotation; a++)
+    {
+      subset_views[a % n_subsets].push_back(a);
+    }
+
+    // Preallocated work buffers: ray lengths through the FOV (row sums,
+    // filled by each forward projection), forward projection/residual and
+    // image update. The backprojection gives every pixel in the FOV one
+    // sample per view, so the column sums are the subset size.
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    std::vector<double> ray_length(size_t(num_channels)*proj_per_rotation);
+    std::vector<double> residual(size_t(num_channels)*proj_per_rotation);
+    std::vector<double> update(num_pixels);
+    if(verbose)
+    {
+      std::cout << "OS-SART setup time: " << (omp_get_wtime() - start_time) <<
+          " s\n";
+    }
+
+    // Iterations
+    double previous_norm = 0.0;
+    double proj_norm = 0.0;
+    for(size_t n = 0; n < proj.size(); n++) proj_norm += proj[n]*proj[n];
+    proj_norm = sqrt(proj_norm);
+    for(int it = 0; it < n_iterations; it++)
+    {
+      double iteration_start = omp_get_wtime();
+      double residual_norm = 0.0;
+      for(int k = 0; k < n_subsets; k++)
+      {
+        const std::vector<int> &views = subset_views[subset_order[k]];
+        const int n_views = views.size();
+        // Forward project and normalize residual by ray length
+        #pragma omp parallel for schedule(dynamic) \
+            reduction(+:residual_norm) num_threads(threads)
+        for(int v = 0; v < n_views; v++)
+        {
+          const size_t offset = size_t(num_channels)*views[v];
+          double * r = &residual[offset];
+          ForwardProjectView(&iterative_image[0], lookups, views[v], r,
+              &ray_length[offset]);
+          for(int c = 0; c < num_channels; c++)
+          {
+            double diff = proj[offset + c] - r[c];
+            residual_norm += diff*diff;
+            r[c] = (ray_length[offset + c] > 0.0) ?
+                (diff / ray_length[offset + c]) : 0.0;
+          }
+        }
+        // Backproject and update image (non-negative, inside FOV)
+        BackprojectSubset(&residual[0], lookups, &p_gamma[0], views,
+            &update[0]);
+        const double step = relaxation / double(n_views);
+        #pragma omp parallel for num_threads(threads)
+        for(size_t p = 0; p < num_pixels; p++)
+        {
+          if(!lookups.in_fov[p]) continue;
+          double mu = iterative_image[p] + step*update[p];
+          iterative_image[p] = std::max(mu, 0.0);
+        }
+      }
+      residual_norm = sqrt(residual_norm) / proj_norm;
+      if(verbose)
+      {
+        std::cout << "Iteration " << (it+1) << ": relative residual " <<
+            residual_norm << ", time " <<
+            (omp_get_wtime() - iteration_start) << " s\n";
+      }
+      if(it > 0 && tolerance > 0.0 &&
+          (previous_norm - residual_norm) < tolerance*previous_norm)
+      {
+        if(verbose)
+        {
+          std::cout << "Residual converged, stopping after " << (it+1) <<
+              " iterations\n";
+        }
+        break;
+      }
+      previous_norm = residual_norm;
+    }
+
+    // Convert to HU
+    size_t image_offset = image_data.size();
+    image_data.resize(image_offset + num_pixels);
+    for(size_t p = 0; p < num_pixels; p++)
+    {
+      if(!lookups.in_fov[p]) image_data[image_offset + p] = -1000;
+      else
+      {
+        image_data[image_offset + p] = round(1000*((iterative_image[p] -
+            mu_water)/(mu_water - mu_air)));
+      }
+    }
+    slice_spacing = num_rows*row_width;
+    if(verbose)
+    {
+      std::cout << "Total time: " << (omp_get_wtime() - start_time) << " s\n";
+    }
+  }
+
+  // Reconstruct helically acquired fan beam images FBP and linear interpolation
+  void RayCT::HelicalFIFBP(double pitch, double z_start, int n_rotations)
+  {
+    HelicalFIFBP(pitch, z_start, n_rotations, 0.0, 0.0);
+  }
+
+  // Reconstruct a volume of helical FI-FBP images, from slice_start to
+  // slice_end (cm) spaced by the z-filter width. Slices are processed in
+  // batches: z-interpolation of each slice's axial projections runs in
+  // parallel, the batch is filtered together, then each slice is
+  // backprojected into the preallocated image volume.
+  void RayCT::HelicalFIFBP(double pitch, double z_start, int n_rotations,
+      double slice_start, double slice_end)
+  {
     // Initialization
-    std::ofstream fout;
-    time_t start_time, end_time;
-    double TimeLookup, TimeBack, TimeBackTotal;
-    omp_set_num_threads(omp_get_max_threads());
+    double start_time;
+    double TimeLookup, TimeInterp = 0.0, TimeFilter = 0.0, TimeBackTotal = 0.0;
 
     /////////////////////
     // Input variables //
@@ -378,34 +1638,33 @@ namespace solutio
     // Projection z-filtering
     int num_interp_points = 7;
     double FW = 0.3;
-    double slice_start = 0.0;
-    //double slice_end = 2.0;
 
     // Image reconstruction
-    int num_images = 1;//floor((slice_end-slice_start)/FW) - 1; //52
-    double sinc_a = 1.0;
+    int num_images = 1;
+    if(slice_end > slice_start)
+    {
+      num_images += int(floor((slice_end-slice_start)/FW + 1.0e-9));
+    }
 
     /////////////////////////////////////////////////////////////////
     // Preliminary calculations and projection data pre-processing //
     /////////////////////////////////////////////////////////////////
-    std::cout << "Preliminary calculations and projection data preprocessing...\n";
-
-    // Set source spectrum
-    std::vector<double> energies;
-    for(int e = 0; e < 151; e++){ energies.push_back(double(e)); }
-    std::vector<double> source_spectrum = Tasmip(tube_potential, 0.0,
-        "Aluminum", data_folder);
+    if(verbose)
+    {
+      std::cout << "Preliminary calculations and projection data " <<
+          "preprocessing...\n";
+    }
 
-    // Calculate mean beam energy for reconstruction
-    // and attenuation coefficient for air and water (for CT #'s)
-    NistPad NistAir(data_folder, "Air");
-    NistPad NistWater(data_folder, "Water");
-    double mean_energy = 0.0, mu_air, mu_water;
-    for(int e = 0; e < 151; e++) mean_energy += source_spectrum[e]*double(e);
-    mean_energy /= 1000.0;
-    mu_air = NistAir.LinearAttenuation(mean_energy);
-    mu_water = NistWater.LinearAttenuation(mean_energy);
-    std::cout << mean_energy << '\t' << mu_air << '\t' << mu_water << '\n';
+    // Mean beam energy for reconstruction and attenuation coefficients for
+    // air and water (for CT #'s)
+    const SpectralData &spectral = GetSpectralData();
+    double mean_energy = spectral.mean_energy;
+    double mu_air = spectral.mean_mu_air;
+    double mu_water = spectral.mean_mu_water;
+    if(verbose)
+    {
+      std::cout << mean_energy << '\t' << mu_air << '\t' << mu_water << '\n';
+    }
 
     // Angle gamma for a row of projection data
     double p_gamma[(const int)(num_channels)];
@@ -414,501 +1673,1533 @@ namespace solutio
       p_gamma[c] = (-fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle);
     }
 
+    // 180 degree complementary data: view offset and interpolation weight
+    // between neighboring views for each channel
+    std::vector<int> comp_shift(num_channels);
+    std::vector<double> comp_f(num_channels);
+    for(int c = 0; c < num_channels; c++)
+    {
+      double shift = (2.0*p_gamma[c]*double(proj_per_rotation))/(2.0*M_PI);
+      comp_shift[c] = proj_per_rotation/2 + int(ceil(shift));
+      comp_f[c] = fabs(ceil(shift) - shift);
+    }
+
     /////////////////////////////
     // Calculate lookup tables //
     /////////////////////////////
-    time(&start_time);
-    std::cout << "Calculating backprojection lookup tables...\n";
+    start_time = omp_get_wtime();
+    if(verbose) std::cout << "Calculating backprojection lookup tables...\n";
+
+    // Lookup table for helical projection z-values (monotone in both view
+    // and row)
+    double table_motion = pitch * num_rows * row_width;
+    int num_helical_proj = proj_per_rotation * n_rotations;
+    std::vector<double> Z(size_t(num_helical_proj)*num_rows);
+    for(int n = 0; n < num_helical_proj; n++)
+    {
+      for(int r = 0; r < num_rows; r++)
+      {
+        Z[(num_rows*n + r)] = z_start +
+            (table_motion*(double(n)/double(proj_per_rotation))) +
+            (row_width*(double(r)-(double(num_rows)/2.0)+0.5));
+      }
+    }
+
+    // Lookup tables for fan-beam reconstruction
+    BackprojectionLookups lookups;
+    CalcLookups(lookups);
+    slice_spacing = FW;
+    TimeLookup = omp_get_wtime() - start_time;
+
+    ////////////////////
+    // Axial FBP loop //
+    ////////////////////
+
+    if(verbose)
+    {
+      std::cout << "Beginning reconstruction of " << num_images <<
+          " image(s)...\n";
+    }
+
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    const int batch_size = std::min(num_images, threads);
+    const size_t slice_size = size_t(num_channels)*proj_per_rotation;
+    const size_t view_size = size_t(num_rows)*num_channels;
+    std::vector<double> batch_proj(slice_size*batch_size);
+
+    // Interpolation tables: for each slice, gantry angle and z-filter point,
+    // the closest helical rows (projection data offset and z-position) at
+    // or below and above the point, among the rows within reach of the
+    // slice. Complementary tables leave out the last view, since
+    // complementary data needs the following view as well.
+    struct HelicalBracket
+    {
+      long lower, upper;    // -1 if there is no such row
+      double z_lower, z_upper;
+    };
+    const size_t table_size =
+        size_t(batch_size)*proj_per_rotation*num_interp_points;
+    std::vector<HelicalBracket> direct_table(table_size);
+    std::vector<HelicalBracket> comp_table(table_size);
+
+    size_t image_offset = image_data.size();
+    image_data.resize(image_offset + size_t(num_images)*matrix_size*matrix_size);
+
+    long missing_samples = 0;
+    for(int b0 = 0; b0 < num_images; b0 += batch_size)
+    {
+      const int n_batch = std::min(batch_size, num_images - b0);
+      if(verbose)
+      {
+        std::cout << "Reconstructing images " << (b0+1) << "-" <<
+            (b0+n_batch) << " out of " << num_images << "...\n";
+      }
+
+      // 1. Fill the interpolation tables of each slice and angle; Z is
+      // monotone in row, so rows are found by binary search
+      start_time = omp_get_wtime();
+      #pragma omp parallel for collapse(2) schedule(dynamic) num_threads(threads)
+      for(int s = 0; s < n_batch; s++)
+      {
+        for(int q = 0; q < proj_per_rotation; q++)
+        {
+          double slice_z = slice_start + double(b0+s)*FW;
+          double z_lo = slice_z-(FW/2.0)-1.0, z_hi = slice_z+(FW/2.0)+1.0;
+          const size_t t0 = (size_t(proj_per_rotation)*s + q)*num_interp_points;
+          HelicalBracket * direct = &direct_table[t0];
+          HelicalBracket * comp = &comp_table[t0];
+          for(int ip = 0; ip < num_interp_points; ip++)
+          {
+            direct[ip].lower = direct[ip].upper = -1;
+            comp[ip].lower = comp[ip].upper = -1;
+          }
+          for(int v = q; v < num_helical_proj; v += proj_per_rotation)
+          {
+            const double * z_view = &Z[size_t(num_rows)*v];
+            int r_begin = std::lower_bound(z_view, z_view+num_rows, z_lo) - z_view;
+            int r_end = std::upper_bound(z_view, z_view+num_rows, z_hi) - z_view;
+            if(r_begin >= r_end) continue;
+            const long view_offset = long(view_size)*v;
+            const int n_tables = (v < num_helical_proj-1) ? 2 : 1;
+            for(int ip = 0; ip < num_interp_points; ip++)
+            {
+              double current_z = slice_z - (FW/2.0) +
+                  (FW*(double(ip)/double(num_interp_points-1)));
+              int k = std::upper_bound(z_view+r_begin, z_view+r_end,
+                  current_z) - z_view;
+              for(int t = 0; t < n_tables; t++)
+              {
+                HelicalBracket &b = (t == 0) ? direct[ip] : comp[ip];
+                if(k > r_begin && (b.lower < 0 || z_view[k-1] > b.z_lower))
+                {
+                  b.lower = view_offset + long(num_channels)*(k-1);
+                  b.z_lower = z_view[k-1];
+                }
+                if(k < r_end && (b.upper < 0 || z_view[k] < b.z_upper))
+                {
+                  b.upper = view_offset + long(num_channels)*k;
+                  b.z_upper = z_view[k];
+                }
+              }
+            }
+          }
+        }
+      }
+
+      // 2. Sample direct and complementary data for each channel from the
+      // closest rows of either, and filter in z w/ linear interpolation
+      #pragma omp parallel for collapse(2) schedule(dynamic) \
+          num_threads(threads) reduction(+:missing_samples)
+      for(int s = 0; s < n_batch; s++)
+      {
+        for(int p = 0; p < proj_per_rotation; p++)
+        {
+          const HelicalBracket * direct = &direct_table[
+              (size_t(proj_per_rotation)*s + p)*num_interp_points];
+          double * slice_proj = &batch_proj[slice_size*s];
+          for(int c = 0; c < num_channels; c++)
+          {
+            int q = (p + comp_shift[c]) % proj_per_rotation;
+            if(q < 0) q += proj_per_rotation;
+            const HelicalBracket * comp = &comp_table[
+                (size_t(proj_per_rotation)*s + q)*num_interp_points];
+            const int proj_ind = (num_channels-1) - c;
+            const double f = comp_f[c];
+            // Rows within reach give every filter point a neighbor
+            if(direct[0].lower < 0 && direct[0].upper < 0 &&
+                comp[0].lower < 0 && comp[0].upper < 0)
+            {
+              slice_proj[num_channels*p + c] = 0.0;
+              missing_samples++;
+              continue;
+            }
+            // Newly sampled set within filter width (FW), then filter and
+            // assign to axial projection data; the nearest row is used at
+            // the ends of the data
+            double sample = 0.0;
+            double weight = 1.0 / double(num_interp_points);
+            for(int ip = 0; ip < num_interp_points; ip++)
+            {
+              const HelicalBracket &d = direct[ip], &m = comp[ip];
+              bool comp_lower = (m.lower >= 0 &&
+                  (d.lower < 0 || m.z_lower >= d.z_lower));
+              bool comp_upper = (m.upper >= 0 &&
+                  (d.upper < 0 || m.z_upper < d.z_upper));
+              long lower = comp_lower ? m.lower : d.lower;
+              long upper = comp_upper ? m.upper : d.upper;
+              double p_lower = 0.0, p_upper = 0.0;
+              if(lower >= 0)
+              {
+                p_lower = comp_lower ? (f*projection_data[lower + view_size +
+                    proj_ind] + (1-f)*projection_data[lower + proj_ind]) :
+                    projection_data[lower + c];
+              }
+              if(upper >= 0)
+              {
+                p_upper = comp_upper ? (f*projection_data[upper + view_size +
+                    proj_ind] + (1-f)*projection_data[upper + proj_ind]) :
+                    projection_data[upper + c];
+              }
+              double current_p = (upper >= 0) ? p_upper : p_lower;
+              if(lower >= 0 && upper >= 0)
+              {
+                double z_lower = comp_lower ? m.z_lower : d.z_lower;
+                double z_upper = comp_upper ? m.z_upper : d.z_upper;
+                double dz = z_upper - z_lower;
+                double current_z = slice_start + double(b0+s)*FW - (FW/2.0) +
+                    (FW*(double(ip)/double(num_interp_points-1)));
+                if(dz > 0.0)
+                {
+                  double w = (current_z - z_lower) / dz;
+                  current_p = w*p_upper + (1-w)*p_lower;
+                }
+              }
+              sample += (weight*current_p);
+            }
+            slice_proj[num_channels*p + c] = sample;
+          }
+        }
+      }
+      TimeInterp += omp_get_wtime() - start_time;
+
+      // 3. Beam hardening correction (soft tissue only), fan-beam weighting
+      // and filtering for the whole batch
+      start_time = omp_get_wtime();
+      TissueBHC(spectral, &batch_proj[0], n_batch*proj_per_rotation);
+      #pragma omp parallel for num_threads(threads)
+      for(int p = 0; p < n_batch*proj_per_rotation; p++)
+      {
+        for(int c = 0; c < num_channels; c++)
+        {
+          batch_proj[(size_t(num_channels)*p+c)] *=
+              (scanner_radius*cos(p_gamma[c]));
+        }
+      }
+      FilterProjections1D(&batch_proj[0], n_batch*proj_per_rotation);
+      TimeFilter += omp_get_wtime() - start_time;
+
+      // 4. Backproject each slice into the image volume
+      start_time = omp_get_wtime();
+      for(int s = 0; s < n_batch; s++)
+      {
+        WeightedBackprojection(&batch_proj[slice_size*s], lookups, p_gamma,
+            mu_water, mu_air, &image_data[image_offset +
+            size_t(b0+s)*matrix_size*matrix_size]);
+      }
+      TimeBackTotal += omp_get_wtime() - start_time;
+    }
+    if(missing_samples > 0)
+    {
+      std::cout << "Error: helical projection z-range does not include " <<
+          "current slice! (" << missing_samples << " projection samples)\n";
+    }
+
+    if(verbose)
+    {
+      std::cout.precision(3);
+      std::cout << "Lookup table calculation time: " << TimeLookup << " s\n";
+      std::cout << "Helical interpolation time: " << TimeInterp << " s\n";
+      std::cout << "Projection processing/filtering time: " << TimeFilter <<
+          " s\n";
+      std::cout << "Weighted backprojection time: " << TimeBackTotal << " s\n";
+      std::cout << "Total time: " <<
+          (TimeLookup+TimeInterp+TimeFilter+TimeBackTotal) << " s\n";
+    }
+  }
+
+  // Insert a zero-padded file number before the file extension
+  static std::string SplitFileName(std::string file_name, int n)
+  {
+    std::string ext = "";
+    size_t dot = file_name.find_last_of('.');
+    size_t slash = file_name.find_last_of('/');
+    if(dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    {
+      ext = file_name.substr(dot);
+      file_name = file_name.substr(0, dot);
+    }
+    std::string number = std::to_string(n);
+    while(number.size() < 3) number = "0" + number;
+    return file_name + "_" + number + ext;
+  }
+
+  // Remove a MetaImage/raw file extension, if given
+  static std::string MetaImageBaseName(std::string file_name)
+  {
+    size_t n = file_name.size();
+    if(n > 4 && (file_name.substr(n-4) == ".mhd" ||
+        file_name.substr(n-4) == ".raw"))
+    {
+      file_name = file_name.substr(0, n-4);
+    }
+    return file_name;
+  }
+
+  void RayCT::WriteProjectionData(std::string file_name, bool split)
+  {
+    std::ofstream fout;
+    const size_t view_size = projection_data.ViewSize();
+    size_t views_per_file = projection_data.NumViews();
+    if(split) views_per_file = proj_per_rotation;
+    if(views_per_file == 0) return;
+    // A last partial rotation goes to its own, shorter file
+    const size_t num_views = projection_data.NumViews();
+    size_t n_files = (num_views + views_per_file - 1) / views_per_file;
+    for(size_t f = 0; f < n_files; f++)
+    {
+      std::string name = split ? SplitFileName(file_name, f) : file_name;
+      size_t view_end = std::min((f+1)*views_per_file, num_views);
+      fout.open(name.c_str());
+      for(size_t n = f*views_per_file*view_size; n < view_end*view_size; n++)
+      {
+        fout << projection_data[n] << '\n';
+      }
+      fout.close();
+    }
+  }
+
+  void RayCT::WriteImageData(std::string file_name, bool split)
+  {
+    std::ofstream fout;
+    const size_t slice_size = size_t(matrix_size)*matrix_size;
+    size_t n_slices = (slice_size > 0) ? image_data.size() / slice_size : 0;
+    if(!split)
+    {
+      fout.open(file_name.c_str());
+      for(size_t n = 0; n < image_data.size(); n++)
+      {
+        fout << image_data[n] << '\n';
+      }
+      fout.close();
+      return;
+    }
+    for(size_t s = 0; s < n_slices; s++)
+    {
+      fout.open(SplitFileName(file_name, s).c_str());
+      for(size_t n = s*slice_size; n < (s+1)*slice_size; n++)
+      {
+        fout << image_data[n] << '\n';
+      }
+      fout.close();
+    }
+  }
+
+  bool RayCT::WriteProjectionDataBinary(std::string file_name, bool split,
+      bool background)
+  {
+    std::string base_name = MetaImageBaseName(file_name);
+    const bool single = projection_data.IsSinglePrecision();
+    const size_t element_bytes = single ? sizeof(float) : sizeof(double);
+    const char * data = single ? (const char *)projection_data.FloatData() :
+        (const char *)projection_data.DoubleData();
+    const size_t view_bytes = projection_data.ViewSize()*element_bytes;
+    size_t views_per_file = projection_data.NumViews();
+    if(split) views_per_file = proj_per_rotation;
+    if(data == NULL || views_per_file == 0) return true;
+
+    std::vector<double> spacing;
+    spacing.push_back(10.0*channel_width);
+    spacing.push_back(10.0*row_width);
+    spacing.push_back(1.0);
+    // A last partial rotation goes to its own, shorter file
+    const size_t num_views = projection_data.NumViews();
+    size_t n_files = (num_views + views_per_file - 1) / views_per_file;
+    bool success = true;
+    for(size_t f = 0; f < n_files; f++)
+    {
+      std::string name = split ? SplitFileName(base_name, f) : base_name;
+      size_t file_views = std::min(views_per_file,
+          num_views - f*views_per_file);
+      std::vector<int> dims;
+      dims.push_back(num_channels);
+      dims.push_back(num_rows);
+      dims.push_back(file_views);
+      // Projection data is not reallocated until pending writes finish (see
+      // SimulateViews), so background writes read it in place
+      const char * file_data = data + f*views_per_file*view_bytes;
+      size_t file_bytes = file_views*view_bytes;
+      auto task = [name, dims, spacing, single, file_data, file_bytes]()
+      {
+        return WriteMetaImageHeader(name + ".mhd", name + ".raw", dims,
+            spacing, single ? "MET_FLOAT" : "MET_DOUBLE") &&
+            WriteBinaryChunked(name + ".raw", file_data, file_bytes);
+      };
+      if(background) pending_writes.push_back(std::async(std::launch::async, task));
+      else if(!task()) success = false;
+    }
+    return success;
+  }
+
+  bool RayCT::WriteImageDataBinary(std::string file_name, bool split,
+      bool background)
+  {
+    std::string base_name = MetaImageBaseName(file_name);
+    const size_t slice_size = size_t(matrix_size)*matrix_size;
+    size_t n_slices = (slice_size > 0) ? image_data.size() / slice_size : 0;
+    if(n_slices == 0) return true;
+
+    // Pixel spacing in mm (image index = matrix_size*i + j, with j fastest)
+    std::vector<double> spacing;
+    spacing.push_back(10.0*recon_fov/double(matrix_size));
+    spacing.push_back(10.0*recon_fov/double(matrix_size));
+    spacing.push_back(10.0*((slice_spacing > 0.0) ? slice_spacing : 1.0));
+    size_t slices_per_file = split ? 1 : n_slices;
+    bool success = true;
+    for(size_t f = 0; f < n_slices/slices_per_file; f++)
+    {
+      std::string name = split ? SplitFileName(base_name, f) : base_name;
+      std::vector<int> dims;
+      dims.push_back(matrix_size);
+      dims.push_back(matrix_size);
+      dims.push_back(slices_per_file);
+      const int * first = &image_data[f*slices_per_file*slice_size];
+      size_t n_values = slices_per_file*slice_size;
+      if(background)
+      {
+        // Image data may grow with the next reconstruction, so write a copy
+        std::vector<int> data(first, first + n_values);
+        pending_writes.push_back(std::async(std::launch::async,
+            [name, dims, spacing, data]()
+            {
+              return WriteMetaImageHeader(name + ".mhd", name + ".raw", dims,
+                  spacing, "MET_INT") && WriteBinaryChunked(name + ".raw",
+                  (const char *)&data[0], data.size()*sizeof(int));
+            }));
+      }
+      else if(!WriteMetaImageHeader(name + ".mhd", name + ".raw", dims,
+          spacing, "MET_INT") || !WriteBinaryChunked(name + ".raw",
+          (const char *)first, n_values*sizeof(int)))
+      {
+        success = false;
+      }
+    }
+    return success;
+  }
+
+  bool RayCT::WaitForWrites()
+  {
+    bool success = true;
+    for(int n = 0; n < pending_writes.size(); n++)
+    {
+      if(!pending_writes[n].get()) success = false;
+    }
+    pending_writes.clear();
+    return success;
+  }
+
+  void RayCT::ResetStatistics()
+  {
+    statistics = RayCTStatistics();
+  }
+
+  bool RayCT::WriteStatistics(std::string file_name)
+  {
+    std::ofstream file(file_name.c_str());
+    if(!file.is_open())
+    {
+      std::cout << "Error: could not open statistics file " << file_name <<
+          "!\n";
+      return false;
+    }
+    file.precision(9);
+    file << "{\n";
+    file << "  \"stage_time_s\": {\n";
+    file << "    \"spectrum\": " << statistics.spectrum_time << ",\n";
+    file << "    \"acquisition\": " << statistics.acquisition_time << ",\n";
+    file << "    \"noise\": " << statistics.noise_time << ",\n";
+    file << "    \"normalization\": " << statistics.normalization_time <<
+        ",\n";
+    file << "    \"bhc\": " << statistics.bhc_time << ",\n";
+    file << "    \"filtering\": " << statistics.filter_time << ",\n";
+    file << "    \"lookup\": " << statistics.lookup_time << ",\n";
+    file << "    \"backprojection\": " << statistics.backprojection_time <<
+        "\n";
+    file << "  },\n";
+    file << "  \"counters\": {\n";
+    file << "    \"rays_traced\": " << statistics.rays_traced << ",\n";
+    file << "    \"object_intersections\": " <<
+        statistics.object_intersections << ",\n";
+    file << "    \"gamma_out_of_range\": " << statistics.gamma_out_of_range <<
+        "\n";
+    file << "  }\n";
+    file << "}\n";
+    file.close();
+    return !file.fail();
+  }
+
+  /////////////////////////
+  // Ancillary Functions //
+  /////////////////////////
+
+  // Statistics may be updated from several threads (e.g. streaming stages
+  // or concurrent ROI recons)
+  void RayCT::AddStageTime(double &stage_time, double start_time)
+  {
+    AddStageDuration(stage_time, omp_get_wtime() - start_time);
+  }
+
+  void RayCT::AddStageDuration(double &stage_time, double duration)
+  {
+    #pragma omp critical(rayct_statistics)
+    stage_time += duration;
+  }
+
+  void RayCT::AddCount(long &counter, long n)
+  {
+    #pragma omp critical(rayct_statistics)
+    counter += n;
+  }
+
+  void RayCT::ObjectProjection(ObjectModelXray &M, double angle, double z,
+      RayTraceWork &work, double projection[])
+  {
+    const double cos_a = cos(angle);
+    const double sin_a = sin(angle);
+    const double * dx = &channel_dx[0];
+    const double * dy = &channel_dy[0];
+
+    // Set source position (z position always equal to 0)
+    Ray3 source_ray;
+    source_ray.origin.Set(scanner_radius*cos_a, scanner_radius*sin_a, z);
+
+    // Calculate attenuation for each source ray; ray directions are the
+    // channel vectors rotated to the source angle
+    const long start_tests = work.intersection_tests;
+    for(int r = 0; r < num_rows; r++)
+    {
+      double * row_projection = &projection[num_channels*r];
+      source_ray.direction.z = row_dz[r];
+      for(int c = 0; c < num_channels; c++)
+      {
+        source_ray.direction.x = dx[c]*cos_a - dy[c]*sin_a;
+        source_ray.direction.y = dx[c]*sin_a + dy[c]*cos_a;
+        // Find path length for each tissue ray passes through
+        row_projection[c] = M.GetRayAttenuation(source_ray, work);
+      }
+    }
+    AddCount(statistics.rays_traced, long(num_rows)*num_channels);
+    AddCount(statistics.object_intersections,
+        work.intersection_tests - start_tests);
+  }
+
+  // Tabulate attenuation lists of the model for a spectrum, with optional
+  // spectral compression and transmission lookup table (reported if
+  // verbose)
+  void RayCT::TabulateModel(ObjectModelXray &M, const SpectralData &spectral)
+  {
+    M.SetVerbose(verbose);
+    M.TabulateAttenuationLists(spectral.energies, spectral.spectrum,
+        spectral_tolerance);
+    if(transmission_tolerance > 0.0)
+    {
+      // Longest ray is the source to detector distance
+      M.TabulateTransmission(transmission_tolerance, 2.0*scanner_radius);
+    }
+  }
+
+  // Material path lengths for each ray of one view (all model materials,
+  // stored per ray)
+  void RayCT::ObjectPathlengths(ObjectModelXray &M, double angle, double z,
+      RayTraceWork &work, float lengths[])
+  {
+    const double cos_a = cos(angle);
+    const double sin_a = sin(angle);
+    const int num_materials = work.material_lengths.size();
+    Ray3 source_ray;
+    source_ray.origin.Set(scanner_radius*cos_a, scanner_radius*sin_a, z);
+    const long start_tests = work.intersection_tests;
+    for(int r = 0; r < num_rows; r++)
+    {
+      source_ray.direction.z = row_dz[r];
+      for(int c = 0; c < num_channels; c++)
+      {
+        source_ray.direction.x = channel_dx[c]*cos_a - channel_dy[c]*sin_a;
+        source_ray.direction.y = channel_dx[c]*sin_a + channel_dy[c]*cos_a;
+        M.CalcMaterialPathlengths(source_ray, work);
+        float * L = &lengths[size_t(num_materials)*(num_channels*r + c)];
+        for(int m = 0; m < num_materials; m++)
+        {
+          L[m] = float(work.material_lengths[m]);
+        }
+      }
+    }
+    AddCount(statistics.rays_traced, long(num_rows)*num_channels);
+    AddCount(statistics.object_intersections,
+        work.intersection_tests - start_tests);
+  }
 
-    // Lookup table for helical projection z-values
-    int z_index;
-    double table_motion = pitch * num_rows * row_width;
-    int num_helical_proj = proj_per_rotation * n_rotations;
-    double * Z = new double [(num_helical_proj*num_rows)];
-    for(int n = 0; n < num_helical_proj; n++)
+  // Trace the material path lengths of a set of views (same view order as
+  // SimulateViews). Materials that no ray passes through are then removed
+  // from the stored data.
+  void RayCT::TracePathlengths(ObjectModelXray &M, int n_views,
+      double z_start, double z_per_view)
+  {
+    const int view_size = num_rows*num_channels;
+    RayTraceWork init_work;
+    M.InitRayTraceWork(init_work);
+    const int num_materials = init_work.material_lengths.size();
+    pathlength_model_materials = num_materials;
+    pathlength_views = n_views;
+    pathlength_radius = scanner_radius;
+    pathlength_channels = num_channels;
+    pathlength_channel_width = channel_width;
+    pathlength_rows = num_rows;
+    pathlength_row_width = row_width;
+    pathlength_proj_per_rotation = proj_per_rotation;
+    pathlength_data.assign(size_t(num_materials)*view_size*n_views, 0.0f);
+
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    if(verbose)
     {
-      for(int r = 0; r < num_rows; r++)
+      std::cout << "Tracing " << n_views << " projections (" << threads <<
+          " threads)...\n";
+    }
+    double start_time = omp_get_wtime();
+    #pragma omp parallel num_threads(threads)
+    {
+      RayTraceWork work;
+      M.InitRayTraceWork(work);
+      #pragma omp for schedule(dynamic)
+      for(int n = 0; n < n_views; n++)
       {
-        z_index = num_rows*n + r;
-        Z[z_index] = z_start + (table_motion*(double(n)/double(proj_per_rotation))) +
-            (row_width*(double(r)-(double(num_rows)/2.0)+0.5));
+        double angle = (2.0*M_PI*double(n % proj_per_rotation)) /
+            double(proj_per_rotation);
+        double z = z_start + (double(n) * z_per_view);
+        ObjectPathlengths(M, angle, z, work,
+            &pathlength_data[size_t(num_materials)*view_size*n]);
       }
     }
+    AddStageTime(statistics.acquisition_time, start_time);
 
-    // Lookup tables for fan-beam reconstruction
-    double xy_table[(const int)(matrix_size)];
-    double * L = new double [(matrix_size*matrix_size*proj_per_rotation)];
-    double * gamma = new double [(matrix_size*matrix_size*proj_per_rotation)];
-    double pixel_dim = CalcLookups(xy_table, L, gamma);
-
-    time(&end_time);
-    TimeLookup = difftime(end_time,start_time) / 60;
-
-    ////////////////////
-    // Axial FBP loop //
-    ////////////////////
+    // Keep only materials with non-zero path length in any ray
+    std::vector<char> used(num_materials, 0);
+    const size_t num_rays = size_t(view_size)*n_views;
+    for(size_t p = 0; p < num_rays; p++)
+    {
+      for(int m = 0; m < num_materials; m++)
+      {
+        if(pathlength_data[num_materials*p + m] != 0.0f) used[m] = 1;
+      }
+    }
+    pathlength_materials.clear();
+    for(int m = 0; m < num_materials; m++)
+    {
+      if(used[m]) pathlength_materials.push_back(m);
+    }
+    const int num_stored = pathlength_materials.size();
+    if(num_stored < num_materials)
+    {
+      for(size_t p = 0; p < num_rays; p++)
+      {
+        for(int m = 0; m < num_stored; m++)
+        {
+          pathlength_data[num_stored*p + m] =
+              pathlength_data[num_materials*p + pathlength_materials[m]];
+        }
+      }
+      pathlength_data.resize(num_stored*num_rays);
+      pathlength_data.shrink_to_fit();
+    }
+    if(verbose)
+    {
+      std::cout << "Stored path lengths for " << num_stored << " of " <<
+          num_materials << " materials\n";
+    }
+  }
 
-    std::cout << "Beginning image reconstruction...\n";
+  // Simulate a set of views (source angle and z-position increase with view
+  // index). If first_view is 0 the projection data is allocated, otherwise
+  // views [first_view, n_views) are added to the existing data. Views are
+  // distributed across threads; each view is written at a fixed offset, so
+  // the result does not depend on the number of threads. With checkpoint
+  // set, views are simulated in chunks of the checkpoint interval and saved
+  // to the checkpoint file after each chunk.
+  void RayCT::SimulateViews(ObjectModelXray &M, int n_views, double z_start,
+      double z_per_view, int first_view, bool checkpoint)
+  {
+    const int view_size = num_rows*num_channels;
+    if(first_view == 0)
+    {
+      WaitForWrites();
+      if(!projection_data.Allocate(n_views, num_rows, num_channels,
+          single_precision_storage, projection_file))
+      {
+        return;
+      }
+    }
 
-    // Select axial slice data for reconstruction, using filtered linear
-    // interpolation from the helical data
-    for(int n = 0; n < num_images; n++)
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    int progress_step = std::max(1, n_views/10);
+    int completed = first_view;
+    int chunk_size = checkpoint ? checkpoint_interval : n_views;
+    if(verbose)
+    {
+      std::cout << "Simulating " << (n_views-first_view) <<
+          " projections (" << threads << " threads)...\n";
+    }
+    double start_time = omp_get_wtime();
+    for(int chunk = first_view; chunk < n_views; chunk += chunk_size)
     {
-      time(&start_time);
-      std::cout << "Reconstructing image " << (n+1) << " out of " << num_images << "...\t";
-      double slice_z = slice_start + double(n)*FW;
-      double interp_f;
-      int buffer_size, interp_angle, proj_ind, angle_180;
-      double slice_proj[(const int)(num_channels*proj_per_rotation)];
-      double current_z, current_p, sample, weight;
-      for(int p = 0; p < proj_per_rotation; p++)
+      const int chunk_end = std::min(n_views, chunk + chunk_size);
+      #pragma omp parallel num_threads(threads)
       {
-        for(int c = 0; c < num_channels; c++)
+        // Ray tracing scratch buffers, one set per thread
+        RayTraceWork work;
+        M.InitRayTraceWork(work);
+        std::vector<double> view_data(view_size);
+        #pragma omp for schedule(dynamic)
+        for(int n = chunk; n < chunk_end; n++)
         {
-          // 1. Sample the projection values and z-positions for complementary data
-          std::pair<double,double> temp_buffer;
-          std::vector< std::pair<double,double> > proj_buffer;
-
-          // 1a. Direct data and/or 360 degree complementary data
-          interp_angle = p;
-          while(interp_angle >= 0) interp_angle -= proj_per_rotation;
-          interp_angle += proj_per_rotation;
-          while(interp_angle < num_helical_proj)
-          {
-            for(int r = 0; r < num_rows; r++)
-            {
-              if(Z[(num_rows*interp_angle + r)] < (slice_z-(FW/2.0)-1.0))
-              {
-                continue;
-              }
-              else if(Z[(num_rows*interp_angle + r)] > (slice_z+(FW/2.0)+1.0))
-              {
-                continue;
-              }
-              else
-              {
-                temp_buffer.first = Z[(num_rows*interp_angle + r)];
-                temp_buffer.second =
-                    projection_data[(interp_angle*num_rows*num_channels + r*num_channels + c)];
-                proj_buffer.push_back(temp_buffer);
-              }
-            }
-            interp_angle += proj_per_rotation;
-          }
-          // 1b. 180 degree complementary data
-          interp_angle = (p + proj_per_rotation/2) +
-              ceil((2.0*p_gamma[c]*double(proj_per_rotation))/(2.0*M_PI));
-          while(interp_angle >= 0) interp_angle -= proj_per_rotation;
-          interp_angle += proj_per_rotation;
-          interp_f = fabs(ceil((2.0*p_gamma[c]*double(proj_per_rotation))/(2.0*M_PI))
-           - ((2.0*p_gamma[c]*double(proj_per_rotation))/(2.0*M_PI)));
-          proj_ind = (num_channels-1) - c;
-          while(interp_angle < (num_helical_proj-1))
+          double angle = (2.0*M_PI*double(n % proj_per_rotation)) /
+              double(proj_per_rotation);
+          double z = z_start + (double(n) * z_per_view);
+          ObjectProjection(M, angle, z, work, &view_data[0]);
+          projection_data.WriteView(n, &view_data[0]);
+          // Progress is printed about every 10% of views
+          if(verbose)
           {
-            for(int r = 0; r < num_rows; r++)
+            #pragma omp critical(rayct_progress)
             {
-              if(Z[(num_rows*interp_angle + r)] < (slice_z-(FW/2.0)-1.0))
-              {
-                continue;
-              }
-              else if(Z[(num_rows*interp_angle + r)] > (slice_z+(FW/2.0)+1.0))
+              completed++;
+              if(completed % progress_step == 0 || completed == n_views)
               {
-                continue;
-              }
-              else {
-                temp_buffer.first = Z[(num_rows*interp_angle + r)];
-                temp_buffer.second =
-                    interp_f*(projection_data[((interp_angle+1)*num_rows*num_channels + r*num_channels + proj_ind)]) +
-                    (1-interp_f)*(projection_data[(interp_angle*num_rows*num_channels + r*num_channels + proj_ind)]);
-                proj_buffer.push_back(temp_buffer);
+                std::cout << "Simulated projection " << completed << " of " <<
+                    n_views << '\n';
               }
             }
-            interp_angle += proj_per_rotation;
-          }
-          // 1c. Sort data by z-value
-          std::sort(proj_buffer.begin(), proj_buffer.end());
-          // 2. Create newly sampled set within filter width (FW) via linear interpolation
-          std::vector<double> proj_interp, z_interp;
-          if(proj_buffer.size() == 0)
-          {
-            std::cout << "Error: helical projection z-range does not include current slice!\n";
-            std::cout << "(@ Projection " << n << ", channel " << c << ")\n";
-            continue;
           }
-          for(int ip = 0; ip < num_interp_points; ip++)
-          {
-            current_z = slice_z - (FW/2.0) + (FW*(double(ip)/double(num_interp_points-1)));
-            current_p = LinearInterpolation(proj_buffer, current_z);
-            proj_interp.push_back(current_p);
-            z_interp.push_back(current_z);
-          }
-          // 3. Filter set and assign to axial projection data
-          sample = 0.0;
-          weight = 1.0 / double(num_interp_points);
-          for(int ip = 0; ip < proj_interp.size(); ip++)
-          {
-            sample += (weight*proj_interp[ip]);
-          }
-          slice_proj[num_channels*p + c] = sample;
         }
       }
-
-      fout.open("slice_initial.txt");
-      for(int p = 0; p < proj_per_rotation; p++)
+      // A failed write leaves the checkpoint at the last good chunk
+      if(checkpoint && !AppendCheckpoint(chunk, chunk_end))
       {
-        for(int c = 0; c < num_channels; c++)
-        {
-          fout << slice_proj[(num_channels*p+c)] << '\n';
-        }
+        std::cout << "Error: checkpointing stopped at projection " <<
+            chunk << "!\n";
+        checkpoint = false;
       }
-      fout.close();
+    }
+    AddStageTime(statistics.acquisition_time, start_time);
+  }
 
-      // Beam hardening correction, step 1 (soft tissue only)
-      TissueBHC(source_spectrum, slice_proj, mean_energy);
+  // Add photon and electronic noise to n_values detector signals. The
+  // generator is seeded from (seed, stream, index), where the stream is a
+  // noise realization number or the acquisition/air scan stream and the
+  // index is the view, so the noise does not depend on thread count or
+  // processing order, and a resumed acquisition reproduces it.
+  void RayCT::AddPoissonNoise(double projection[], size_t n_values,
+      unsigned long long stream, unsigned long long index)
+  {
+    std::seed_seq seq{(unsigned long long)(random_seed & 0xffffffff),
+        (unsigned long long)(random_seed >> 32), stream, index};
+    std::mt19937_64 generator(seq);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    const double electronic_sd = sqrt(10.0);
+    double input;
+    for(size_t p = 0; p < n_values; p++)
+    {
+      input = projection[p];
+      // Photon statistics: a normal sample with mean equal to the signal is
+      // added, so the signal is doubled (as in the air scan)
+      input += input + sqrt(input)*normal(generator);
+      input += electronic_sd*normal(generator);    // Electronic noise
+      if(input <= 0.0) input = 0.1;
+      projection[p] = input;
+    }
+  }
 
-      // Fan-beam projection weighting
-      for(int p = 0; p < proj_per_rotation; p++)
+  // Scale simulated transmission to photon counts, add noise and normalize
+  // to the air scan, one view at a time
+  void RayCT::NormalizeProjections()
+  {
+    const int view_size = num_rows*num_channels;
+    std::vector<double> view_data(view_size);
+    // Keep the noiseless expected counts for noise realizations, if asked
+    expected_counts.Clear();
+    if(keep_expected_counts)
+    {
+      std::string counts_file = "";
+      if(projection_file != "") counts_file = projection_file + ".counts";
+      expected_counts.Allocate(projection_data.NumViews(), num_rows,
+          num_channels, single_precision_storage, counts_file);
+    }
+    double start_time = omp_get_wtime();
+    double noise_time = 0.0;
+    for(size_t n = 0; n < projection_data.NumViews(); n++)
+    {
+      projection_data.ReadView(n, &view_data[0]);
+      for(int p = 0; p < view_size; p++) view_data[p] *= num_photons;
+      if(expected_counts.size() != 0)
       {
-        for(int c = 0; c < num_channels; c++)
-        {
-          slice_proj[(num_channels*p+c)] *= (scanner_radius*cos(p_gamma[c]));
-        }
+        expected_counts.WriteView(n, &view_data[0]);
       }
-
-      // Filter projection data
-      FilterProjections1D(slice_proj);
-
-      fout.open("slice_filtered.txt");
-      for(int p = 0; p < proj_per_rotation; p++)
+      double noise_start = omp_get_wtime();
+      AddPoissonNoise(&view_data[0], view_size, acquisition_stream, n);
+      noise_time += omp_get_wtime() - noise_start;
+      for(int p = 0; p < view_size; p++)
       {
-        for(int c = 0; c < num_channels; c++)
-        {
-          fout << slice_proj[(num_channels*p+c)] << '\n';
-        }
+        view_data[p] = log(air_scan_data[p] / view_data[p]);
       }
-      fout.close();
+      projection_data.WriteView(n, &view_data[0]);
+    }
+    // Noise is timed separately from scaling and normalization
+    AddStageDuration(statistics.noise_time, noise_time);
+    AddStageDuration(statistics.normalization_time,
+        omp_get_wtime() - start_time - noise_time);
+  }
 
-      // Perform initial backprojection
-      time(&start_time);
-      std::vector<int> slice = WeightedBackprojection(slice_proj, xy_table,
-          L, gamma, p_gamma, mu_water, mu_air);
-      for(int p = 0; p < (matrix_size*matrix_size); p++)
+  // Tabulate the source spectrum and the attenuation data used by
+  // acquisition and reconstruction. The NIST data files are read once per
+  // source configuration; later calls return the cached data.
+  const SpectralData &RayCT::GetSpectralData()
+  {
+    std::tuple<int, double, std::string> key(tube_potential, filtration,
+        filter_material);
+    std::map< std::tuple<int, double, std::string>, SpectralData >::iterator
+        it = spectral_cache.find(key);
+    double start_time = omp_get_wtime();
+    if(it != spectral_cache.end())
+    {
+      if(it->second.bhc_max_thickness != bhc_max_thickness)
       {
-        image_data.push_back(slice[p]);
+        CalcTissueBHCTable(it->second);
+        AddStageTime(statistics.spectrum_time, start_time);
       }
+      return it->second;
+    }
 
-      time(&end_time);
-      TimeBack = difftime(end_time,start_time) / 60.0;
-      TimeBackTotal += TimeBack;
+    SpectralData &data = spectral_cache[key];
+    data.spectrum = Tasmip(tube_potential, filtration, filter_material,
+        data_folder);
+    NistPad NistAir(data_folder, "Air");
+    NistPad NistWater(data_folder, "Water");
+    NistPad NistTissue(data_folder, "Tissue4");
 
-      std::cout << TimeBack << " minutes.\n";
+    // Attenuation coefficients for each energy bin
+    const int num_bins = data.spectrum.size();
+    data.energies.assign(num_bins, 0.0);
+    data.mu_air.assign(num_bins, 0.0);
+    data.mu_water.assign(num_bins, 0.0);
+    data.mu_tissue.assign(num_bins, 0.0);
+    data.mean_energy = 0.0;
+    for(int e = 0; e < num_bins; e++)
+    {
+      data.energies[e] = double(e) / 1000.0;
+      data.mean_energy += data.spectrum[e]*data.energies[e];
+      if(e == 0) continue;
+      data.mu_air[e] = NistAir.LinearAttenuation(data.energies[e]);
+      data.mu_water[e] = NistWater.LinearAttenuation(data.energies[e]);
+      data.mu_tissue[e] = NistTissue.LinearAttenuation(data.energies[e]);
     }
+    data.mean_mu_air = NistAir.LinearAttenuation(data.mean_energy);
+    data.mean_mu_water = NistWater.LinearAttenuation(data.mean_energy);
+    data.mean_mu_tissue = NistTissue.LinearAttenuation(data.mean_energy);
 
-    std::cout.precision(3);
-    std::cout << "Lookup table calculation time: " << TimeLookup << " min.\n";
-    std::cout << "Weighted backprojection time: " << TimeBackTotal << " min.\n";
-    std::cout << "Total time: " << (TimeLookup+TimeBackTotal) << " min.\n";
-
-    delete [] Z;
-    delete [] L;
-    delete [] gamma;
+    CalcTissueBHCTable(data);
+    AddStageTime(statistics.spectrum_time, start_time);
+    return data;
   }
 
-  void RayCT::WriteProjectionData(std::string file_name, bool split)
+  // Make the inverse beam hardening table for soft tissue. The forward
+  // relation (thickness to polychromatic -ln T) is sampled finely and is
+  // monotone, so it is inverted by a single merge pass onto a uniform grid
+  // of projection values.
+  void RayCT::CalcTissueBHCTable(SpectralData &data)
   {
-    std::ofstream fout;
-    if(split)
-    {
-
-    }
-    else
+    const int num_bins = data.spectrum.size();
+    const double d_step = 0.05;
+    const int num_samples = std::max(int(ceil(bhc_max_thickness/d_step)), 1) + 1;
+    double total = 0.0;
+    for(int e = 1; e < num_bins; e++) total += data.spectrum[e];
+
+    // Forward table (stops early if transmission underflows)
+    std::vector<double> fwd_thickness, fwd_projection;
+    for(int d = 0; d < num_samples; d++)
     {
-      fout.open(file_name.c_str());
-      for(int n = 0; n < projection_data.size(); n++)
+      double thickness = d*d_step;
+      double sum = 0.0;
+      for(int e = 1; e < num_bins; e++)
       {
-        fout << projection_data[n] << '\n';
+        if(data.spectrum[e] == 0.0) continue;
+        sum += (data.spectrum[e]*exp(-data.mu_tissue[e]*thickness));
       }
-      fout.close();
+      if(sum <= 0.0) break;
+      double p = -log(sum/total);
+      if(d > 0 && p <= fwd_projection.back()) break;
+      fwd_thickness.push_back(thickness);
+      fwd_projection.push_back(p);
+    }
+
+    // Inverse table on a uniform projection grid
+    const int table_size = 4096;
+    data.bhc_max_thickness = bhc_max_thickness;
+    data.bhc_thickness.assign(table_size, 0.0);
+    data.bhc_step = 1.0;
+    if(fwd_projection.size() < 2) return;
+    data.bhc_step = fwd_projection.back() / double(table_size-1);
+    size_t k = 1;
+    for(int n = 0; n < table_size; n++)
+    {
+      double p = n*data.bhc_step;
+      while(k < fwd_projection.size()-1 && fwd_projection[k] < p) k++;
+      double f = (p - fwd_projection[k-1]) /
+          (fwd_projection[k] - fwd_projection[k-1]);
+      data.bhc_thickness[n] = fwd_thickness[k-1] +
+          f*(fwd_thickness[k] - fwd_thickness[k-1]);
     }
   }
 
-  void RayCT::WriteImageData(std::string file_name, bool split)
+  // Replace each projection value with the monochromatic (mean energy)
+  // value of the equivalent soft tissue thickness. Values past the end of
+  // the table are extrapolated from the last interval.
+  void RayCT::TissueBHC(const SpectralData &spectral, double proj[],
+      int num_views, int n_threads)
   {
-    std::ofstream fout;
-    if(split)
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    if(n_threads > 0) threads = n_threads;
+    const double * table = &spectral.bhc_thickness[0];
+    const int last = spectral.bhc_thickness.size() - 2;
+    const double inv_step = 1.0 / spectral.bhc_step;
+    const double mu = spectral.mean_mu_tissue;
+    const long num_values = long(num_views)*num_channels;
+    double start_time = omp_get_wtime();
+    #pragma omp parallel for num_threads(threads)
+    for(long n = 0; n < num_values; n++)
     {
+      double p = proj[n];
+      if(p <= 0.0) continue;
+      double u = p*inv_step;
+      int k = (u < double(last)) ? int(u) : last;
+      double f = u - double(k);
+      proj[n] = mu*(table[k] + f*(table[k+1] - table[k]));
+    }
+    AddStageTime(statistics.bhc_time, start_time);
+  }
 
+  // Ramp filter num_views consecutive projections (num_channels each) in
+  // place. All views are transformed together with batched FFTs; the plans,
+  // buffer and filter response are reused while the configuration is
+  // unchanged. Fan-beam data is filtered unless a parallel-beam detector
+  // spacing is given.
+  void RayCT::FilterProjections1D(double proj[], int num_views,
+      double parallel_spacing, int n_threads)
+  {
+    double start_time = omp_get_wtime();
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    if(n_threads > 0) threads = n_threads;
+    bool parallel = (parallel_spacing > 0.0);
+    double spacing = parallel ? parallel_spacing : d_fan_angle;
+    RampFilterPlan * plan = ramp_filter_plan.get();
+    if(plan == NULL || plan->num_views != num_views ||
+        plan->num_channels != num_channels || plan->spacing != spacing ||
+        plan->parallel != parallel || plan->threads != threads)
+    {
+      ramp_filter_plan.reset();
+      plan = new RampFilterPlan(num_views, num_channels, spacing, parallel,
+          threads);
+      ramp_filter_plan.reset(plan);
     }
-    else
+
+    const int padded_size = plan->padded_size;
+    const int proj_padding = plan->proj_padding;
+    const int freq_size = plan->freq_size;
+    const std::vector<double> &ramp = plan->ramp_response;
+
+    // Get projection data & add padding
+    #pragma omp parallel for num_threads(threads)
+    for(int n = 0; n < num_views; n++)
     {
-      fout.open(file_name.c_str());
-      for(int n = 0; n < image_data.size(); n++)
+      double * padded_proj = (double *)(plan->buffer + size_t(freq_size)*n);
+      for(int c = 0; c < padded_size; c++)
       {
-        fout << image_data[n] << '\n';
+        if(c < proj_padding || c > (num_channels+proj_padding-1))
+        {
+          padded_proj[c] = 0.0;
+        }
+        else padded_proj[c] = proj[(size_t(num_channels)*n+(c-proj_padding))];
       }
-      fout.close();
     }
-  }
-
-  /////////////////////////
-  // Ancillary Functions //
-  /////////////////////////
-
-  std::vector<double> RayCT::ObjectProjection(ObjectModelXray &M, double angle,
-      double z, std::vector<double> spectrum)
-  {
-    std::vector<double> projection;
-    double gamma, x0, y0, x1, y1;
-    Vec3<double> source_position, detector_pos;
-    Ray3 source_ray;
 
-    // Set source position (z position always equal to 0)
-    x0 = scanner_radius*cos(angle);// + (-1.0*0.5*channel_width*sin(angle));
-    y0 = scanner_radius*sin(angle);// + (0.5*channel_width*cos(angle));
-    source_position.Set(x0, y0, z);
+    // Take Fourier transforms and apply filter
+    plan->forward->fft((double *)plan->buffer, plan->buffer);
+    #pragma omp parallel for num_threads(threads)
+    for(int n = 0; n < num_views; n++)
+    {
+      Complex * freq = plan->buffer + size_t(freq_size)*n;
+      for(int f = 0; f < freq_size; f++) freq[f] *= ramp[f];
+    }
+    plan->backward->fftNormalized(plan->buffer, (double *)plan->buffer);
 
-    // Calculate attenuation for each source ray
-    for(int r = 0; r < num_rows; r++)
+    // Remove padding
+    #pragma omp parallel for num_threads(threads)
+    for(int n = 0; n < num_views; n++)
     {
+      double * padded_proj = (double *)(plan->buffer + size_t(freq_size)*n);
       for(int c = 0; c < num_channels; c++)
       {
-        // Set initial detector coordinates
-        Ray3 source_ray;
-        x1 = scanner_radius*(2.0*cos((M_PI - fan_angle/2.0 + d_fan_angle/2.0
-            + c*d_fan_angle)) + 1.0);
-        y1 = 2.0*scanner_radius*sin((M_PI - fan_angle/2.0 + d_fan_angle/2.0
-            + c*d_fan_angle));
-        // Rotate to source angle
-        detector_pos.x = x1*cos(angle) - y1*sin(angle);
-        detector_pos.y = x1*sin(angle) + y1*cos(angle);
-        detector_pos.z = z + (2.0*row_width * (double(r) -
-            (double(num_rows)/2.0) + 0.5));
-        // Shift for 1/4 detector offset
-        //detector_pos.x += (-1.0*0.5*channel_width*sin(angle));
-        //detector_pos.y += (0.5*channel_width*cos(angle));
-        // Assign ray parameters
-        source_ray.SetRay(source_position, detector_pos - source_position);
-
-        // Find path length for each tissue ray passes through
-        double intensity = M.GetRayAttenuation(source_ray, spectrum);
-        projection.push_back(intensity);
+        proj[(size_t(num_channels)*n+c)] =
+            spacing*padded_proj[proj_padding+c];
       }
     }
-
-    return projection;
+    AddStageTime(statistics.filter_time, start_time);
   }
 
-  void RayCT::AddPoissonNoise(std::vector<double> &projection)
+  void RayCT::CalcLookups(BackprojectionLookups &lookups)
   {
-    double input;
-    srand(time(0));
-    for(int p = 0; p < projection.size(); p++)
+    double start_time = omp_get_wtime();
+    lookups.pixel_dim = recon_fov / double(matrix_size);
+    lookups.x.resize(matrix_size);
+    lookups.y.resize(matrix_size);
+    for(int n = 0; n < matrix_size; n++)
     {
-      input = projection[p];
-      input += RandNormal(input, sqrt(input)); // Photon statistics
-      input += RandNormal(0.0, sqrt(10.0));    // Electronic noise
-      if(input <= 0.0) input = 0.1;
-      projection[p] = input;
+      lookups.x[n] =
+          lookups.pixel_dim*(float(n - (float(matrix_size)/2.0)) + 0.5);
+      lookups.y[n] = lookups.x[n];
+    }
+    lookups.in_fov.resize(matrix_size*matrix_size);
+    for(int i = 0; i < matrix_size; i++)
+    {
+      for(int j = 0; j < matrix_size; j++)
+      {
+        lookups.in_fov[matrix_size*i+j] = (sqrt(pow(lookups.x[i],2.0) +
+            pow(lookups.y[j],2.0)) <= (recon_fov/2.0));
+      }
     }
+
+    // For pixel (x, y) and view angle a, the distance from the source along
+    // the central ray is U = R + x*sin(a) - y*cos(a), and the perpendicular
+    // offset is V = x*cos(a) + y*sin(a); then L^2 = U^2 + V^2 and
+    // gamma = atan2(V, U)
+    lookups.cos_view.resize(proj_per_rotation);
+    lookups.sin_view.resize(proj_per_rotation);
+    double angle;
+    for(int a = 0; a < proj_per_rotation; a++)
+    {
+      angle = (2.0*M_PI*double(a))/double(proj_per_rotation)-(M_PI/2.0);
+      lookups.cos_view[a] = cos(angle);
+      lookups.sin_view[a] = sin(angle);
+    }
+    if(float_backprojection) CalcFloatLookups(lookups);
+    AddStageTime(statistics.lookup_time, start_time);
   }
 
-  void RayCT::NormalizeProjections()
+  // Lookups for an ROI grid; pixels outside the reconstruction FOV are
+  // masked out, as in CalcLookups
+  void RayCT::CalcROILookups(BackprojectionLookups &lookups, ImageROI &roi)
   {
-    int n_total = projection_data.size() / (num_rows*num_channels);
-    for(int n = 0; n < n_total; n++)
+    double start_time = omp_get_wtime();
+    roi.x_size = std::max(1, int(round(roi.width / roi.pixel_size)));
+    roi.y_size = std::max(1, int(round(roi.height / roi.pixel_size)));
+    lookups.pixel_dim = roi.pixel_size;
+    lookups.x.resize(roi.x_size);
+    lookups.y.resize(roi.y_size);
+    for(int i = 0; i < roi.x_size; i++)
     {
-      for(int r = 0; r < num_rows; r++)
+      lookups.x[i] = roi.center_x +
+          roi.pixel_size*(double(i) - double(roi.x_size)/2.0 + 0.5);
+    }
+    for(int j = 0; j < roi.y_size; j++)
+    {
+      lookups.y[j] = roi.center_y +
+          roi.pixel_size*(double(j) - double(roi.y_size)/2.0 + 0.5);
+    }
+    lookups.in_fov.resize(size_t(roi.x_size)*roi.y_size);
+    for(int i = 0; i < roi.x_size; i++)
+    {
+      for(int j = 0; j < roi.y_size; j++)
       {
-        for(int c = 0; c < num_channels; c++)
-        {
-          double norm = log(
-              air_scan_data[(num_channels*r+c)] /
-              projection_data[(num_rows*num_channels*n+num_channels*r+c)] );
-          projection_data[(num_rows*num_channels*n+num_channels*r+c)] = norm;
-        }
+        lookups.in_fov[size_t(roi.y_size)*i+j] =
+            (sqrt(pow(lookups.x[i],2.0) + pow(lookups.y[j],2.0)) <=
+            (recon_fov/2.0));
       }
     }
+
+    // View angles as in CalcLookups
+    lookups.cos_view.resize(proj_per_rotation);
+    lookups.sin_view.resize(proj_per_rotation);
+    for(int a = 0; a < proj_per_rotation; a++)
+    {
+      double angle =
+          (2.0*M_PI*double(a))/double(proj_per_rotation)-(M_PI/2.0);
+      lookups.cos_view[a] = cos(angle);
+      lookups.sin_view[a] = sin(angle);
+    }
+    if(float_backprojection) CalcFloatLookups(lookups);
+    AddStageTime(statistics.lookup_time, start_time);
   }
 
-  void RayCT::TissueBHC(std::vector<double> spectrum, double proj[],
-      double recon_energy)
+  // Accumulate the parallel-beam backprojection of all views (direction
+  // angle 2*pi*k/N, detector positions t_min + c*dt) into image_sum (not
+  // scaled by the angular step). For pixel (x, y), t = x*sin(theta) -
+  // y*cos(theta), which is linear along an image row, so the inner loop has
+  // no distance weights or trigonometric functions. Tiles are distributed
+  // across threads as in BackprojectViews.
+  void RayCT::BackprojectParallelViews(const double proj[],
+      const BackprojectionLookups &lookups, double t_min, double dt,
+      double image_sum[])
   {
-    // Make attenuation lookup table for soft tissue
-    int ind;
-    double energy, sum, p, T_e, m;
-    std::vector<double> dist;
-    std::vector<double> table;
-    NistPad NistTissue(data_folder, "Tissue4");
-    for(int d = 0; d < 100; d++)
+    const int x_size = lookups.x.size();
+    const int y_size = lookups.y.size();
+    const int tile_size = 32;
+    const int view_block = 16;
+    const int x_tiles = (x_size + tile_size - 1) / tile_size;
+    const int y_tiles = (y_size + tile_size - 1) / tile_size;
+    const double * x = lookups.x.data();
+    const double * y = lookups.y.data();
+    const char * in_fov = lookups.in_fov.data();
+    std::vector<double> sin_theta(proj_per_rotation);
+    std::vector<double> cos_theta(proj_per_rotation);
+    for(int k = 0; k < proj_per_rotation; k++)
+    {
+      double theta = (2.0*M_PI*double(k)) / double(proj_per_rotation);
+      sin_theta[k] = sin(theta);
+      cos_theta[k] = cos(theta);
+    }
+
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    double start_time = omp_get_wtime();
+    #pragma omp parallel for collapse(2) schedule(dynamic) num_threads(threads)
+    for(int ti = 0; ti < x_tiles; ti++)
     {
-      sum = 0.0;
-      dist.push_back(double(d));
-      for(int e = 0; e < 151; e++)
+      for(int tj = 0; tj < y_tiles; tj++)
       {
-        if(spectrum[e] == 0.0) continue;
-        energy = double(e) / 1000.0;
-        sum += (spectrum[e]*exp(-NistTissue.LinearAttenuation(energy)*dist[d]));
+        const int i_end = std::min(x_size, (ti+1)*tile_size);
+        const int j_begin = tj*tile_size;
+        const int j_end = std::min(y_size, j_begin + tile_size);
+        for(int k0 = 0; k0 < proj_per_rotation; k0 += view_block)
+        {
+          const int k_end = std::min(proj_per_rotation, k0 + view_block);
+          for(int i = ti*tile_size; i < i_end; i++)
+          {
+            double * sum = &image_sum[size_t(y_size)*i];
+            const char * mask = &in_fov[size_t(y_size)*i];
+            for(int k = k0; k < k_end; k++)
+            {
+              // Detector position in units of dt: u = u0 + j*du
+              const double u0 = (x[i]*sin_theta[k] - t_min) / dt;
+              const double du = -cos_theta[k] / dt;
+              const double * p_view = &proj[size_t(num_channels)*k];
+              #pragma omp simd
+              for(int j = j_begin; j < j_end; j++)
+              {
+                double u = u0 + y[j]*du;
+                u = std::min(std::max(u, 0.0), double(num_channels - 1));
+                int index = std::min(int(u), num_channels - 2);
+                double f = u - double(index);
+                double p = f*p_view[index+1] + (1-f)*p_view[index];
+                sum[j] += mask[j] ? p : 0.0;
+              }
+            }
+          }
+        }
       }
-      table.push_back(-log(sum));
     }
-    // Estimate tissue pathlength and apply correction
-    for(int n = 0; n < proj_per_rotation; n++)
+    AddStageTime(statistics.backprojection_time, start_time);
+  }
+
+  // Fan-beam backprojection kernel of BackprojectViews in precision T. The
+  // image is split into square tiles which are distributed across threads;
+  // each tile is accumulated in a local buffer that stays in cache while
+  // every view is added to it, and the innermost loop over pixels in a tile
+  // row is vectorized. In single precision, the tile sums are compensated
+  // (Kahan summation), since each pixel adds up thousands of small terms.
+  template <class T>
+  static long BackprojectFanTiles(const T proj[], const T x[], const T y[],
+      const T cos_view[], const T sin_view[], const char in_fov[], int x_size,
+      int y_size, int num_channels, T radius, T gamma_first, T d_gamma,
+      T gamma_max, int view_begin, int view_end, int threads,
+      double image_sum[])
+  {
+    const int tile_size = 32;
+    const int view_block = 16;
+    const int x_tiles = (x_size + tile_size - 1) / tile_size;
+    const int y_tiles = (y_size + tile_size - 1) / tile_size;
+    const bool compensate = (sizeof(T) < sizeof(double));
+    const T zero = 0;
+    const T last_channel = T(num_channels - 1);
+
+    long out_of_range = 0;
+    #pragma omp parallel for collapse(2) schedule(dynamic) \
+        num_threads(threads) reduction(+:out_of_range)
+    for(int ti = 0; ti < x_tiles; ti++)
     {
-      for(int c = 0; c < num_channels; c++)
+      for(int tj = 0; tj < y_tiles; tj++)
       {
-        p = proj[num_channels*n + c];
-        if(p <= 0.0) continue;
-        T_e = LinearInterpolation(table, dist, p);
-        m = NistTissue.LinearAttenuation(recon_energy)*T_e;
-        proj[num_channels*n + c] = m;
+        const int i_begin = ti*tile_size;
+        const int i_end = std::min(x_size, i_begin + tile_size);
+        const int j_begin = tj*tile_size;
+        const int j_end = std::min(y_size, j_begin + tile_size);
+        const int tile_width = j_end - j_begin;
+        T tile_sum[tile_size*tile_size];
+        T tile_error[tile_size*tile_size];
+        for(int n = 0; n < tile_size*tile_size; n++)
+        {
+          tile_sum[n] = zero;
+          tile_error[n] = zero;
+        }
+        for(int a0 = view_begin; a0 < view_end; a0 += view_block)
+        {
+          const int a_end = std::min(view_end, a0 + view_block);
+          for(int i = i_begin; i < i_end; i++)
+          {
+            T * sum = &tile_sum[tile_size*(i - i_begin)];
+            T * error = &tile_error[tile_size*(i - i_begin)];
+            const char * mask = &in_fov[size_t(y_size)*i + j_begin];
+            const T * y_row = &y[j_begin];
+            for(int a = a0; a < a_end; a++)
+            {
+              const T cos_a = cos_view[a];
+              const T sin_a = sin_view[a];
+              const T U0 = radius + x[i]*sin_a;
+              const T V0 = x[i]*cos_a;
+              const T * p_view = &proj[size_t(num_channels)*(a - view_begin)];
+              #pragma omp simd reduction(+:out_of_range)
+              for(int j = 0; j < tile_width; j++)
+              {
+                T U = U0 - y_row[j]*cos_a;
+                T V = V0 + y_row[j]*sin_a;
+                T gamma = std::atan2(V, U);
+                out_of_range += (mask[j] && std::fabs(gamma) > gamma_max);
+                // Projection value at gamma w/ linear interpolation, clamped
+                // to the detector edges
+                T multiple = (gamma - gamma_first) / d_gamma;
+                multiple = std::min(std::max(multiple, zero), last_channel);
+                int index = std::min(int(multiple), num_channels - 2);
+                T f = multiple - T(index);
+                T p = f*p_view[index+1] + (1-f)*p_view[index];
+                // Weighted backprojection, add to sum (pixels outside the
+                // reconstruction FOV are masked out)
+                T term = mask[j] ? (p/(U*U + V*V)) : zero;
+                if(compensate)
+                {
+                  T corrected = term - error[j];
+                  T total = sum[j] + corrected;
+                  error[j] = (total - sum[j]) - corrected;
+                  sum[j] = total;
+                }
+                else sum[j] += term;
+              }
+            }
+          }
+        }
+        for(int i = i_begin; i < i_end; i++)
+        {
+          double * image_row = &image_sum[size_t(y_size)*i + j_begin];
+          const T * sum = &tile_sum[tile_size*(i - i_begin)];
+          for(int j = 0; j < tile_width; j++) image_row[j] += double(sum[j]);
+        }
       }
     }
+    return out_of_range;
   }
 
-  void RayCT::FilterProjections1D(double proj[])
+  // Float coordinate and view tables for the float backprojection kernel
+  void RayCT::CalcFloatLookups(BackprojectionLookups &lookups)
   {
-    // Set up FFTW
-    fftwpp::fftw::maxthreads = get_max_threads();
-    int two_power = 0;
-    while(pow(2, two_power) < (2*num_channels-1)) two_power++;
-    const unsigned int padded_size = pow(2, two_power);
-    size_t align = sizeof(Complex);
-
-    Array::array1<Complex> ramp_filter(padded_size, align);
-    Array::array1<Complex> padded_proj(padded_size, align);
-
-    fftwpp::fft1d Forward(padded_size, -1);
-    fftwpp::fft1d Backward(padded_size, 1);
+    lookups.x_float.assign(lookups.x.begin(), lookups.x.end());
+    lookups.y_float.assign(lookups.y.begin(), lookups.y.end());
+    lookups.cos_view_float.assign(lookups.cos_view.begin(),
+        lookups.cos_view.end());
+    lookups.sin_view_float.assign(lookups.sin_view.begin(),
+        lookups.sin_view.end());
+  }
 
-    // Create ramp filter in spatial domain
-    const int filter_size = (2*(num_channels-1)) + 1;
-    int nf;
-    int filter_padding = (padded_size-filter_size-1)/2;
-    double filter_original[filter_size];
-    for(int f = 0; f < filter_size; f++)
+  // Accumulate the distance-weighted backprojection of views
+  // [view_begin, view_end), stored from the start of proj, into image_sum
+  // (not scaled by the angular step), with the double or float kernel.
+  // Returns the number of in-FOV samples whose fan angle fell outside the
+  // detector (these use the edge channel value). n_threads overrides the
+  // thread count, and timed = false leaves the time to the caller (e.g. for
+  // concurrent ROIs).
+  long RayCT::BackprojectViews(const double proj[],
+      const BackprojectionLookups &lookups, const double proj_gamma[],
+      int view_begin, int view_end, double image_sum[], int n_threads,
+      bool timed)
+  {
+    const int x_size = lookups.x.size();
+    const int y_size = lookups.y.size();
+    const double gamma_max = fan_angle/2.0 - d_fan_angle/2.0;
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    if(n_threads > 0) threads = n_threads;
+    double start_time = omp_get_wtime();
+    long out_of_range = 0;
+    if(!float_backprojection || int(lookups.x_float.size()) != x_size)
     {
-      nf = (-num_channels+1) + f;
-      if(nf == 0) filter_original[f] = 1 / (8*pow(d_fan_angle,2));
-      else
-      {
-        if(nf % 2 == 0) filter_original[f] = 0;
-        else filter_original[f] = -0.5 / pow((M_PI*sin(nf*d_fan_angle)),2);
-      }
+      out_of_range = BackprojectFanTiles<double>(proj, lookups.x.data(),
+          lookups.y.data(), lookups.cos_view.data(), lookups.sin_view.data(),
+          lookups.in_fov.data(), x_size, y_size, num_channels,
+          scanner_radius, proj_gamma[0], d_fan_angle, gamma_max, view_begin,
+          view_end, threads, image_sum);
     }
-    for(int f = 0; f < padded_size; f++)
+    else
     {
-      if(f < filter_padding || f > (filter_size+filter_padding-1)) ramp_filter[f] = 0.0;
-      else ramp_filter[f] = filter_original[(f-filter_padding)];
+      // Float copy of the views being backprojected (one batch or rotation)
+      const size_t num_values = size_t(num_channels)*(view_end - view_begin);
+      std::vector<float> proj_float(proj, proj + num_values);
+      out_of_range = BackprojectFanTiles<float>(&proj_float[0],
+          lookups.x_float.data(), lookups.y_float.data(),
+          lookups.cos_view_float.data(), lookups.sin_view_float.data(),
+          lookups.in_fov.data(), x_size, y_size, num_channels,
+          float(scanner_radius), float(proj_gamma[0]), float(d_fan_angle),
+          float(gamma_max), view_begin, view_end, threads, image_sum);
     }
+    if(timed) AddStageTime(statistics.backprojection_time, start_time);
+    AddCount(statistics.gamma_out_of_range, out_of_range);
+    return out_of_range;
+  }
 
-    // Take FFT
-    Forward.fft(ramp_filter);
-    for(int f = 0; f < padded_size; f++) ramp_filter[f] = abs(ramp_filter[f]);
-
-    // Filter each projection
-    int proj_padding = (padded_size-num_channels)/2;
-    for(int n = 0; n < proj_per_rotation; n++)
+  // Accumulate the FDK backprojection of one rotation of filtered cone-beam
+  // projections (views x rows x channels) into volume_sum, for slices at
+  // slice_dz relative to the source plane (not scaled by the angular step).
+  // The fan angle, distance weight and channel interpolation of each pixel
+  // are shared by all slices; rows are found from the cone angle and
+  // interpolated linearly (clamped to the outer rows). Tiling and threading
+  // follow BackprojectViews.
+  long RayCT::BackprojectConeViews(const double proj[],
+      const BackprojectionLookups &lookups, const double proj_gamma[],
+      const std::vector<double> &slice_dz, double volume_sum[])
+  {
+    const int x_size = lookups.x.size();
+    const int y_size = lookups.y.size();
+    const int num_slices = slice_dz.size();
+    const size_t slice_size = size_t(x_size)*y_size;
+    const int tile_size = 32;
+    const int view_block = 16;
+    const int x_tiles = (x_size + tile_size - 1) / tile_size;
+    const int y_tiles = (y_size + tile_size - 1) / tile_size;
+    const double gamma_max = fan_angle/2.0 - d_fan_angle/2.0;
+    const double * x = lookups.x.data();
+    const double * y = lookups.y.data();
+    const char * in_fov = lookups.in_fov.data();
+
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    double start_time = omp_get_wtime();
+    long out_of_range = 0;
+    #pragma omp parallel num_threads(threads) reduction(+:out_of_range)
     {
-      // Get projection data & add padding
-      for(int c = 0; c < 2048; c++){
-        if(c < proj_padding || c > (num_channels+proj_padding-1)) padded_proj[c] = 0;
-        else padded_proj[c] = proj[((num_channels*n)+(c-proj_padding))];
-      }
-      // Take Fourier transforms and apply filter
-      Forward.fft(padded_proj);
-      for(int f = 0; f < padded_size; f++) padded_proj[f] *= ramp_filter[f];
-      Backward.fftNormalized(padded_proj);
-      // Remove padding
-      for(int c = 0; c < num_channels; c++)
+      // Per-pixel channel interpolation and weights for one tile row
+      std::vector<int> index(tile_size);
+      std::vector<double> f(tile_size), weight(tile_size), inv_L(tile_size);
+      #pragma omp for collapse(2) schedule(dynamic)
+      for(int ti = 0; ti < x_tiles; ti++)
       {
-        proj[(num_channels*n+c)] =
-            d_fan_angle*padded_proj[proj_padding+c].real();
+        for(int tj = 0; tj < y_tiles; tj++)
+        {
+          const int i_end = std::min(x_size, (ti+1)*tile_size);
+          const int j_begin = tj*tile_size;
+          const int nj = std::min(y_size, j_begin + tile_size) - j_begin;
+          for(int a0 = 0; a0 < proj_per_rotation; a0 += view_block)
+          {
+            const int a_end = std::min(proj_per_rotation, a0 + view_block);
+            for(int i = ti*tile_size; i < i_end; i++)
+            {
+              const char * mask = &in_fov[size_t(y_size)*i + j_begin];
+              for(int a = a0; a < a_end; a++)
+              {
+                const double cos_a = lookups.cos_view[a];
+                const double sin_a = lookups.sin_view[a];
+                const double U0 = scanner_radius + x[i]*sin_a;
+                const double V0 = x[i]*cos_a;
+                for(int j = 0; j < nj; j++)
+                {
+                  double U = U0 - y[j_begin+j]*cos_a;
+                  double V = V0 + y[j_begin+j]*sin_a;
+                  double gamma = atan2(V, U);
+                  out_of_range += (mask[j] && fabs(gamma) > gamma_max);
+                  double multiple = (gamma - proj_gamma[0]) / d_fan_angle;
+                  multiple = std::min(std::max(multiple, 0.0),
+                      double(num_channels - 1));
+                  index[j] = std::min(int(multiple), num_channels - 2);
+                  f[j] = multiple - double(index[j]);
+                  double L2 = U*U + V*V;
+                  weight[j] = mask[j] ? (1.0/L2) : 0.0;
+                  inv_L[j] = scanner_radius / sqrt(L2);
+                }
+                const double * p_view =
+                    &proj[size_t(num_rows)*num_channels*a];
+                for(int k = 0; k < num_slices; k++)
+                {
+                  double * sum = &volume_sum[slice_size*k +
+                      size_t(y_size)*i + j_begin];
+                  const double row_dz = slice_dz[k] / row_width;
+                  for(int j = 0; j < nj; j++)
+                  {
+                    // Detector row coordinate from the cone angle
+                    double row = row_dz*inv_L[j] +
+                        (double(num_rows)/2.0) - 0.5;
+                    row = std::min(std::max(row, 0.0), double(num_rows - 1));
+                    int r0 = std::min(int(row), std::max(num_rows - 2, 0));
+                    int r1 = std::min(r0 + 1, num_rows - 1);
+                    double fr = row - double(r0);
+                    const double * p0 = &p_view[size_t(num_channels)*r0];
+                    const double * p1 = &p_view[size_t(num_channels)*r1];
+                    int c = index[j];
+                    double p = (1-fr)*(f[j]*p0[c+1] + (1-f[j])*p0[c]) +
+                        fr*(f[j]*p1[c+1] + (1-f[j])*p1[c]);
+                    sum[j] += p*weight[j];
+                  }
+                }
+              }
+            }
+          }
+        }
       }
     }
+    AddStageTime(statistics.backprojection_time, start_time);
+    AddCount(statistics.gamma_out_of_range, out_of_range);
+    return out_of_range;
   }
 
-  double RayCT::CalcLookups(double xy[], double * L_data, double * gamma_data)
+  // Forward project an image (attenuation coefficients, same layout as the
+  // reconstructed images) for one view, along the rays of ObjectProjection.
+  // Each ray is sampled at half-pixel steps inside the reconstruction FOV
+  // with bilinear interpolation; the ray length inside the FOV is also
+  // returned.
+  void RayCT::ForwardProjectView(const double image[],
+      const BackprojectionLookups &lookups, int view, double proj[],
+      double ray_length[])
   {
-    double pixel_dim = recon_fov / double(matrix_size);
-
-    for(int n = 0; n < matrix_size; n++)
+    const int m = matrix_size;
+    const double pixel_dim = lookups.pixel_dim;
+    const double fov_radius = recon_fov/2.0;
+    const double beta = (2.0*M_PI*double(view)) / double(proj_per_rotation);
+    const double sx = scanner_radius*cos(beta);
+    const double sy = scanner_radius*sin(beta);
+    // Continuous pixel index of position x is x/pixel_dim + offset
+    const double offset = double(m)/2.0 - 0.5;
+    for(int c = 0; c < num_channels; c++)
     {
-      xy[n] = pixel_dim*(float(n - (float(matrix_size)/2.0)) + 0.5);
+      double gamma = -fan_angle/2.0 + d_fan_angle/2.0 + c*d_fan_angle;
+      double ex = -cos(beta + gamma);
+      double ey = -sin(beta + gamma);
+      // Intersection of ray with FOV circle
+      double b = sx*ex + sy*ey;
+      double disc = b*b - (scanner_radius*scanner_radius - fov_radius*fov_radius);
+      proj[c] = 0.0;
+      ray_length[c] = 0.0;
+      if(disc <= 0.0) continue;
+      double t0 = -b - sqrt(disc);
+      double chord = 2.0*sqrt(disc);
+      int n_samples = int(ceil(chord / (0.5*pixel_dim)));
+      double ds = chord / double(n_samples);
+      double sum = 0.0;
+      for(int s = 0; s < n_samples; s++)
+      {
+        double t = t0 + (double(s) + 0.5)*ds;
+        double u = (sx + t*ex)/pixel_dim + offset;
+        double v = (sy + t*ey)/pixel_dim + offset;
+        int i = int(floor(u));
+        int j = int(floor(v));
+        if(i < 0 || j < 0 || i >= m-1 || j >= m-1) continue;
+        double fu = u - double(i);
+        double fv = v - double(j);
+        const double * p0 = &image[size_t(m)*i + j];
+        const double * p1 = p0 + m;
+        sum += (1-fu)*((1-fv)*p0[0] + fv*p0[1]) + fu*((1-fv)*p1[0] + fv*p1[1]);
+      }
+      proj[c] = sum*ds;
+      ray_length[c] = chord;
     }
+  }
 
-    omp_set_num_threads(omp_get_max_threads());
-    double angle, x_offset, y_offset, x;
-    for(int a = 0; a < proj_per_rotation; a++)
+  // Unweighted pixel-driven backprojection of the given views (each view is
+  // num_channels values at its position in proj) into image, which is
+  // overwritten; fan angle and channel interpolation as in BackprojectViews
+  void RayCT::BackprojectSubset(const double proj[],
+      const BackprojectionLookups &lookups, const double proj_gamma[],
+      const std::vector<int> &views, double image[])
+  {
+    const int x_size = lookups.x.size();
+    const int y_size = lookups.y.size();
+    const int n_views = views.size();
+    int threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+    double start_time = omp_get_wtime();
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for(int i = 0; i < x_size; i++)
     {
-      angle = (2.0*M_PI*double(a))/double(proj_per_rotation)-(M_PI/2.0);
-      x_offset = 0.0;//(-1.0*0.5*channel_width*sin(angle));
-      y_offset = 0.0;//(0.5*channel_width*cos(angle));
-      for(int i = 0; i < matrix_size; i++){
-        x = xy[i] - x_offset;
-        #pragma omp parallel for
-        for(int j = 0; j < matrix_size; j++){
-          double y = xy[j] - y_offset;
-          double radius = sqrt(pow(x,2) + pow(y,2));
-          double theta = atan2(y,x);
-          int angle_index = matrix_size*matrix_size*a + matrix_size*i + j;
-          int image_index = matrix_size*i + j;
-          L_data[angle_index] =
-              pow((scanner_radius + radius*sin(angle-theta)),2)
-              + pow(radius*cos(angle-theta),2);
-          gamma_data[angle_index] =
-              atan2((radius*cos(angle-theta)),
-              (scanner_radius+radius*sin(angle-theta)));
+      double * sum = &image[size_t(y_size)*i];
+      const char * mask = &lookups.in_fov[size_t(y_size)*i];
+      for(int j = 0; j < y_size; j++) sum[j] = 0.0;
+      for(int v = 0; v < n_views; v++)
+      {
+        const int a = views[v];
+        const double cos_a = lookups.cos_view[a];
+        const double sin_a = lookups.sin_view[a];
+        const double U0 = scanner_radius + lookups.x[i]*sin_a;
+        const double V0 = lookups.x[i]*cos_a;
+        const double * p_view = &proj[size_t(num_channels)*a];
+        #pragma omp simd
+        for(int j = 0; j < y_size; j++)
+        {
+          double U = U0 - lookups.y[j]*cos_a;
+          double V = V0 + lookups.y[j]*sin_a;
+          double multiple = (atan2(V, U) - proj_gamma[0]) / d_fan_angle;
+          multiple = std::min(std::max(multiple, 0.0),
+              double(num_channels - 1));
+          int index = std::min(int(multiple), num_channels - 2);
+          double f = multiple - double(index);
+          double p = f*p_view[index+1] + (1-f)*p_view[index];
+          sum[j] += mask[j] ? p : 0.0;
         }
       }
     }
-    return pixel_dim;
+    AddStageTime(statistics.backprojection_time, start_time);
   }
 
-  std::vector<int> RayCT::WeightedBackprojection(double proj[], double xy[],
-          double * L_data, double * gamma_data, double proj_gamma[],
-          double mu_water, double mu_air)
+  // Backproject a full rotation of filtered projections and convert to HU,
+  // writing matrix_size^2 values into image
+  void RayCT::WeightedBackprojection(double proj[],
+      const BackprojectionLookups &lookups, double proj_gamma[],
+      double mu_water, double mu_air, int image[], int n_threads, bool timed)
   {
-    //omp_set_num_threads(omp_get_max_threads());
-    std::vector<int> image_slice;
-    double sum;
-    for(int i = 0; i < matrix_size; i++)
+    const int num_pixels = lookups.x.size() * lookups.y.size();
+    std::vector<double> image_sum(num_pixels, 0.0);
+    long out_of_range = BackprojectViews(proj, lookups, proj_gamma, 0,
+        proj_per_rotation, &image_sum[0], n_threads, timed);
+    if(out_of_range > 0)
     {
-      for(int j = 0; j < matrix_size; j++)
+      std::cout << "Warning: gamma outside of projection data range for " <<
+          out_of_range << " pixel/view samples!\n";
+    }
+
+    ConvertToHU(&image_sum[0], lookups, mu_water, mu_air, image);
+  }
+
+  // Average contributions from all angles & convert to HU
+  void RayCT::ConvertToHU(const double image_sum[],
+      const BackprojectionLookups &lookups, double mu_water, double mu_air,
+      int image[])
+  {
+    const int num_pixels = lookups.x.size() * lookups.y.size();
+    const double d_angle = (2.0*M_PI) / double(proj_per_rotation);
+    #pragma omp parallel for
+    for(int p = 0; p < num_pixels; p++)
+    {
+      if(!lookups.in_fov[p]) image[p] = -1000;
+      else
       {
-        // Skip if pixel is outside reconstruction FOV
-        if(sqrt(pow(xy[i],2.0)+pow(xy[j],2.0)) > (recon_fov/2.0))
-        {
-          image_slice.push_back(-1000);
-          continue;
-        }
-        // Else begin backprojection
-        sum = 0.0;
-        //#pragma omp parallel for
-        for(int a = 0; a < proj_per_rotation; a++)
-        {
-          int angle_index = matrix_size*matrix_size*a + matrix_size*i + j;
-          if(fabs(gamma_data[angle_index]) > (fan_angle/2.0 - d_fan_angle/2.0))
-          {
-            std::cout << "Warning: gamma outside of projection data range!\n";
-          }
-          // Determine projection value from gamma, w/ linear interpolation
-          double multiple = (gamma_data[angle_index] - proj_gamma[0]) /
-              d_fan_angle;
-          int index = int(floor(multiple));
-          double f = (gamma_data[angle_index] - proj_gamma[index]) /
-              (proj_gamma[index+1] - proj_gamma[index]);
-          double p = f*proj[(num_channels*a + index + 1)] +
-              (1-f)*proj[num_channels*a + index];
-
-          // Weighted backprojection, add to sum
-          //#pragma omp critical
-          sum += (p/L_data[angle_index]);
-        }
-        // Average contributions from all angles & convert to HU
-        sum *= ((2.0*M_PI) / double(proj_per_rotation));
-        image_slice.push_back(round(1000*((sum-mu_water)/(mu_water-mu_air))));
+        double sum = image_sum[p] * d_angle;
+        image[p] = round(1000*((sum-mu_water)/(mu_water-mu_air)));
       }
     }
-    return image_slice;
   }
 }
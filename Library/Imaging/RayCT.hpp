@@ -36,46 +36,300 @@
 // C++ headers
 #include <vector>
 #include <string>
+#include <memory>
+#include <future>
+#include <map>
+#include <tuple>
+#include <functional>
 
 // Custom headers
 #include "Imaging/ObjectModelXray.hpp"
+#include "Imaging/Sinogram.hpp"
+#include "Utilities/SolutioItk.hpp"
 
 namespace solutio {
+  // Geometry for pixel-driven fan-beam backprojection. Distance weights and
+  // fan angles are evaluated from the per-view rotation during
+  // backprojection, so memory scales with matrix size plus number of views
+  // rather than their product.
+  struct BackprojectionLookups
+  {
+    double pixel_dim;
+    // Pixel center coordinates (image index = y_size*i + j for x[i], y[j])
+    std::vector<double> x;
+    std::vector<double> y;
+    // Reconstruction FOV mask (1 = inside), same indexing as the image
+    std::vector<char> in_fov;
+    // Source rotation for each view
+    std::vector<double> cos_view;
+    std::vector<double> sin_view;
+    // Float copies of the coordinate and view tables (float backprojection
+    // only)
+    std::vector<float> x_float;
+    std::vector<float> y_float;
+    std::vector<float> cos_view_float;
+    std::vector<float> sin_view_float;
+  };
+
+  // Source spectrum and attenuation data for one source configuration
+  // (tube potential and filtration), in 1 keV energy bins from 0 to 150 keV
+  struct SpectralData
+  {
+    std::vector<double> spectrum;
+    // Bin energies (MeV)
+    std::vector<double> energies;
+    // Linear attenuation coefficients (1/cm) of each bin (zero at 0 keV)
+    std::vector<double> mu_air;
+    std::vector<double> mu_water;
+    std::vector<double> mu_tissue;
+    // Mean energy (MeV) and attenuation coefficients at the mean energy
+    double mean_energy;
+    double mean_mu_air;
+    double mean_mu_water;
+    double mean_mu_tissue;
+    // Inverse soft tissue beam hardening table: equivalent tissue thickness
+    // (cm) at uniformly spaced polychromatic projection values (-ln T), from
+    // zero to the value of bhc_max_thickness
+    double bhc_max_thickness;
+    double bhc_step;
+    std::vector<double> bhc_thickness;
+  };
+
+  // Rectangular region of interest for axial recon (cm, isocenter at the
+  // origin); the HU image has x_size*y_size pixels, indexed as in
+  // BackprojectionLookups
+  struct ImageROI
+  {
+    double center_x;
+    double center_y;
+    double width;
+    double height;
+    double pixel_size;
+    int x_size;
+    int y_size;
+    std::vector<int> image;
+  };
+
+  // Wall-clock time (s) spent in each pipeline stage and event counts,
+  // accumulated since construction or the last ResetStatistics. Stages
+  // that run concurrently are timed once around their parallel region;
+  // streaming stages overlap each other, so their times may add up to more
+  // than the total.
+  struct RayCTStatistics
+  {
+    RayCTStatistics() : spectrum_time(0.0), acquisition_time(0.0),
+        noise_time(0.0), normalization_time(0.0), bhc_time(0.0),
+        filter_time(0.0), lookup_time(0.0), backprojection_time(0.0),
+        rays_traced(0), object_intersections(0), gamma_out_of_range(0) {}
+    double spectrum_time;
+    double acquisition_time;
+    double noise_time;
+    double normalization_time;
+    double bhc_time;
+    double filter_time;
+    double lookup_time;
+    double backprojection_time;
+    // Rays traced through the object model, ray-object intersection tests
+    // (geometric models) and backprojection samples outside the fan
+    long rays_traced;
+    long object_intersections;
+    long gamma_out_of_range;
+  };
+
   class RayCT
   {
     public:
+      // Default constructor/destructor
+      RayCT();
+      ~RayCT();
       // Functions to set acquisition/reconstruction parameters
       void SetNistDataFolder(std::string folder);
       void SetGeometry(double radius, int n_c, double d_c, int n_r, double d_r);
       void SetAcquisition(int kVp, double photons, int projs);
+      // Set source filtration thickness (mm) and material (default 0 mm Al)
+      void SetFiltration(double mm, std::string material);
       void SetReconstruction(double r_fov, int m_size);
+      // Set maximum relative transmission error for compressing the source
+      // spectrum to fewer energy bins in projection (0 = no compression)
+      void SetSpectralCompression(double max_error);
+      // Set maximum relative error of a transmission lookup table over
+      // material path lengths, used in projection for models with up to 3
+      // materials (0 = no table)
+      void SetTransmissionTable(double max_error);
+      // Set maximum soft tissue thickness (cm) covered by the beam hardening
+      // correction table; longer paths are extrapolated (default 200 cm)
+      void SetBHCMaxThickness(double max_cm);
+      // Set number of threads used for simulation (0 = all available)
+      void SetNumThreads(int n_threads);
+      // Set projection data storage: single (float) precision and/or a
+      // memory-mapped file (empty name = memory)
+      void SetProjectionStorage(bool single, std::string file_name);
+      // Keep the noiseless expected counts of each acquisition, needed by
+      // GenerateNoiseRealizations (default off). They use the projection
+      // storage settings, with a <projection file>.counts file.
+      void SetKeepExpectedCounts(bool keep);
+      // Use a single (float) precision kernel for fan-beam FBP
+      // backprojection, with compensated sums (default off). Only the
+      // kernel runs in float: filtered views are converted per batch, and
+      // filtering, the filtered sinogram and image sums stay in double, so
+      // memory use is unchanged (see SetProjectionStorage for float
+      // projection data).
+      void SetFloatBackprojection(bool use_float);
+      // Print progress and timing messages, including model tabulation
+      // results (default true); errors and warnings are always printed
+      void SetVerbose(bool print);
       // Functions to perform acquisition/reconstruction
       void AcquireAirScan();
       void AcquireAxialProjections(ObjectModelXray &M, double z);
       void AcquireHelicalProjections(ObjectModelXray &M, double pitch,
           double z_start, int n_rotations);
+      // Save helical acquisition progress to a binary checkpoint file after
+      // every interval views (empty name = no checkpoints)
+      void SetCheckpoint(std::string file_name, int interval);
+      // Continue an interrupted helical acquisition from its checkpoint
+      // file; the scan configuration is restored from the file. The model,
+      // NIST data folder and spectral/transmission tolerances must be the
+      // same as for the original acquisition (the settings are checked)
+      bool ResumeHelicalProjections(ObjectModelXray &M, std::string file_name);
+      // Two-stage acquisition: trace the material path lengths of every ray
+      // once per phantom and scan geometry, then make projections from them
+      // for the current spectrum and photon count (any number of times, e.g.
+      // for a kVp sweep; the air scan must be acquired for each spectrum)
+      void AcquireAxialPathlengths(ObjectModelXray &M, double z);
+      void AcquireHelicalPathlengths(ObjectModelXray &M, double pitch,
+          double z_start, int n_rotations);
+      void ApplySpectrum(ObjectModelXray &M);
+      // Make n_realizations independent noisy versions of the last
+      // acquisition from its noiseless expected counts (see
+      // SetKeepExpectedCounts). Each realization replaces the projection
+      // data, then callback(k) is called (e.g. to reconstruct or write it;
+      // a background write finishes before the next realization starts).
+      // Realization k is the same for a given random seed, whatever the
+      // number of threads.
+      void GenerateNoiseRealizations(int n_realizations,
+          std::function<void(int)> callback);
+      // Set seed for acquisition noise and noise realizations (default is
+      // based on the time)
+      void SetRandomSeed(unsigned long long seed);
       void ReconAxialFBP();
+      // Reconstruct regions of interest (any center, extent and pixel size)
+      // from the filtered sinogram of the last ReconAxialFBP or
+      // StreamAxialFBP; only the ROI pixels are backprojected. Several ROIs
+      // are reconstructed concurrently (threads split between them), and
+      // ReconAxialROI may be called from several threads, optionally with
+      // its own thread count (0 = SetNumThreads value); the stage times of
+      // such concurrent calls add up.
+      bool ReconAxialROI(ImageROI &roi, int n_threads = 0);
+      bool ReconAxialROIs(std::vector<ImageROI> &rois);
+      // Axial FBP after rebinning to parallel-beam projections
+      void ReconAxialParallelFBP();
+      // Streaming axial acquisition and FBP: views are simulated (or read
+      // from the stored projection data) on several threads, then
+      // normalized, corrected and filtered in batches, and backprojected as
+      // they arrive. At most window views are queued between stages, and no
+      // detector data is kept; only the filtered, row-averaged rotation (one
+      // value per view and channel) is kept for ReconAxialROI.
+      void StreamAxialFBP(ObjectModelXray &M, double z, int window = 64);
+      void StreamAxialFBP(int window = 64);
+      // Cone-beam (FDK) recon of a multi-row axial scan; one slice per row
+      // (returns a null pointer if there is no multi-row axial data)
+      ItkImageF3::Pointer ReconAxialFDK();
+      // Iterative (OS-SART) recon of an axial scan; relaxation scales each
+      // update, iterations stop when the relative residual decrease is below
+      // tolerance (0 = never), and a warm start continues from the previous
+      // iterative or reconstructed image
+      void ReconAxialOSSART(int n_iterations, int n_subsets,
+          double relaxation = 1.0, double tolerance = 0.0,
+          bool warm_start = false);
       void HelicalFIFBP(double pitch, double z_start, int n_rotations);
+      void HelicalFIFBP(double pitch, double z_start, int n_rotations,
+          double slice_start, double slice_end);
       // Functions to get acquisition/reconstruction data
-      std::vector<double> GetAirScanData(){ return air_scan_data; }
-      std::vector<double> GetProjectionData(){ return projection_data; }
-      std::vector<int> GetImageData(){ return image_data; }
-      // Functions to write acquisition/reconstruction data to file(s)
+      const std::vector<double> &GetAirScanData() const { return air_scan_data; }
+      const Sinogram &GetProjectionData() const { return projection_data; }
+      // Noiseless detector signal (photons) of the last acquisition
+      const Sinogram &GetExpectedCounts() const { return expected_counts; }
+      const std::vector<int> &GetImageData() const { return image_data; }
+      // Stage timings and counters; WriteStatistics saves them as JSON
+      const RayCTStatistics &GetStatistics() const { return statistics; }
+      void ResetStatistics();
+      bool WriteStatistics(std::string file_name);
+      // Functions to write acquisition/reconstruction data to file(s). Text
+      // files have one value per line; binary files are MetaImage (.mhd
+      // header + .raw data). Split mode writes one file per rotation
+      // (projections) or slice (images), named <name>_NNN. Background writes
+      // run on a separate thread; call WaitForWrites() before using the files.
+      // A trailing partial rotation is written to its own, shorter file. The
+      // binary writers return false if a foreground write fails; background
+      // failures are reported by WaitForWrites().
       void WriteProjectionData(std::string file_name, bool split);
       void WriteImageData(std::string file_name, bool split);
+      bool WriteProjectionDataBinary(std::string file_name, bool split,
+          bool background = false);
+      bool WriteImageDataBinary(std::string file_name, bool split,
+          bool background = false);
+      bool WaitForWrites();
     private:
       // Internally-used ancillary functions
-      std::vector<double> ObjectProjection(ObjectModelXray &M, double angle,
-          double z, std::vector<double> spectrum);
-      void AddPoissonNoise(std::vector<double> &projection);
+      // Add the time since start_time or a duration to a stage, or add to
+      // counters (thread-safe)
+      void AddStageTime(double &stage_time, double start_time);
+      void AddStageDuration(double &stage_time, double duration);
+      void AddCount(long &counter, long n);
+      void ObjectProjection(ObjectModelXray &M, double angle, double z,
+          RayTraceWork &work, double projection[]);
+      void SimulateViews(ObjectModelXray &M, int n_views, double z_start,
+          double z_per_view, int first_view = 0, bool checkpoint = false);
+      bool WriteCheckpointHeader(double pitch, double z_start,
+          int n_rotations);
+      bool AppendCheckpoint(int view_begin, int view_end);
+      void TabulateModel(ObjectModelXray &M, const SpectralData &spectral);
+      void ObjectPathlengths(ObjectModelXray &M, double angle, double z,
+          RayTraceWork &work, float lengths[]);
+      void TracePathlengths(ObjectModelXray &M, int n_views, double z_start,
+          double z_per_view);
+      void AddPoissonNoise(double projection[], size_t n_values,
+          unsigned long long stream, unsigned long long index);
       void NormalizeProjections();
-      void TissueBHC(std::vector<double> spectrum, double proj[],
-          double recon_energy);
-      void FilterProjections1D(double proj[]);
-      double CalcLookups(double xy[], double * L_data, double * gamma_data);
-      std::vector<int> WeightedBackprojection(double proj[], double xy[],
-          double * L_data, double * gamma_data, double proj_gamma[],
-          double mu_water, double mu_air);
+      // Spectrum and attenuation data for the current source configuration,
+      // calculated on first use and cached
+      const SpectralData &GetSpectralData();
+      void CalcTissueBHCTable(SpectralData &data);
+      void TissueBHC(const SpectralData &spectral, double proj[],
+          int num_views, int n_threads = 0);
+      void FilterProjections1D(double proj[], int num_views,
+          double parallel_spacing = 0.0, int n_threads = 0);
+      void CalcLookups(BackprojectionLookups &lookups);
+      void CalcROILookups(BackprojectionLookups &lookups, ImageROI &roi);
+      bool CheckROI(const ImageROI &roi);
+      void BackprojectROI(ImageROI &roi, const BackprojectionLookups &lookups,
+          int n_threads, bool timed);
+      void CalcFloatLookups(BackprojectionLookups &lookups);
+      long BackprojectViews(const double proj[],
+          const BackprojectionLookups &lookups, const double proj_gamma[],
+          int view_begin, int view_end, double image_sum[],
+          int n_threads = 0, bool timed = true);
+      void BackprojectParallelViews(const double proj[],
+          const BackprojectionLookups &lookups, double t_min, double dt,
+          double image_sum[]);
+      long BackprojectConeViews(const double proj[],
+          const BackprojectionLookups &lookups, const double proj_gamma[],
+          const std::vector<double> &slice_dz, double volume_sum[]);
+      void ForwardProjectView(const double image[],
+          const BackprojectionLookups &lookups, int view, double proj[],
+          double ray_length[]);
+      void BackprojectSubset(const double proj[],
+          const BackprojectionLookups &lookups, const double proj_gamma[],
+          const std::vector<int> &views, double image[]);
+      void WeightedBackprojection(double proj[],
+          const BackprojectionLookups &lookups, double proj_gamma[],
+          double mu_water, double mu_air, int image[], int n_threads = 0,
+          bool timed = true);
+      void ConvertToHU(const double image_sum[],
+          const BackprojectionLookups &lookups, double mu_water,
+          double mu_air, int image[]);
+      void StreamFBP(std::function<void(int, int, double[])> source,
+          int source_threads, bool normalize, int window);
       // Data folder for NISTX data
       std::string data_folder;
       // Scanner geometry parameters
@@ -84,20 +338,76 @@ namespace solutio {
       double channel_width;
       int num_rows;
       double row_width;
+      // Detector layout in the gantry frame (source at angle 0): source to
+      // detector element vector for each channel, and z offset of each row;
+      // a view is a rotation of the channel vectors about the z axis
+      std::vector<double> channel_dx;
+      std::vector<double> channel_dy;
+      std::vector<double> row_dz;
       // Acquisition parameters
       int tube_potential;
+      double filtration;
+      std::string filter_material;
       double num_photons;
       int proj_per_rotation;
       double fan_angle;
       double d_fan_angle;
       double scan_fov;
+      double axial_z;
+      // Spectral data for each (kVp, filtration, material) used so far
+      std::map< std::tuple<int, double, std::string>, SpectralData >
+          spectral_cache;
+      double bhc_max_thickness;
+      double spectral_tolerance;
+      double transmission_tolerance;
+      // Simulation parameters
+      int num_threads;
+      std::string checkpoint_file;
+      int checkpoint_interval;
+      long checkpoint_count_offset;
+      bool single_precision_storage;
+      bool float_backprojection;
+      bool keep_expected_counts;
+      std::string projection_file;
+      // Cached FFT plans, buffer and ramp filter response for batched
+      // projection filtering (rebuilt when the view count or geometry change)
+      struct RampFilterPlan;
+      std::unique_ptr<RampFilterPlan> ramp_filter_plan;
       // Recon parameters
       double recon_fov;
       int matrix_size;
+      double slice_spacing;
       // Stored data
       std::vector<double> air_scan_data;
-      std::vector<double> projection_data;
+      Sinogram projection_data;
+      Sinogram expected_counts;
+      unsigned long long random_seed;
+      // Material path lengths (cm) of each ray (view x row x channel), for
+      // the model materials that any ray passes through
+      std::vector<float> pathlength_data;
+      std::vector<int> pathlength_materials;
+      int pathlength_model_materials;
+      int pathlength_views;
+      // Scanner geometry of the traced path lengths
+      double pathlength_radius;
+      int pathlength_channels;
+      double pathlength_channel_width;
+      int pathlength_rows;
+      double pathlength_row_width;
+      int pathlength_proj_per_rotation;
       std::vector<int> image_data;
+      // Row-averaged, corrected and filtered projections of the last axial
+      // FBP (one rotation) and the attenuation coefficients used for HU
+      std::vector<double> filtered_projections;
+      double filtered_mu_water;
+      double filtered_mu_air;
+      // Current iterative recon image (attenuation coefficients)
+      std::vector<double> iterative_image;
+      // Instrumentation
+      RayCTStatistics statistics;
+      bool verbose;
+      // Background file writes
+      std::vector< std::future<bool> > pending_writes;
   };
 }
 
@@ -0,0 +1,222 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright 2016-2018 Steven Dolly                                           */
+/*                                                                            */
+/* Licensed under the Apache License, Version 2.0 (the "License");            */
+/* you may not use this file except in compliance with the License.           */
+/* You may obtain a copy of the License at:                                   */
+/*                                                                            */
+/*     http://www.apache.org/licenses/LICENSE-2.0                             */
+/*                                                                            */
+/* Unless required by applicable law or agreed to in writing, software        */
+/* distributed under the License is distributed on an "AS IS" BASIS,          */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   */
+/* See the License for the specific language governing permissions and        */
+/* limitations under the License.                                             */
+/*                                                                            */
+/******************************************************************************/
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// Sinogram Storage                                                           //
+// (Sinogram.cpp)                                                             //
+//                                                                            //
+// This file contains the container of CT projection data, with heap or       //
+// memory-mapped file storage in double or single precision.                  //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+// Class header
+#include "Sinogram.hpp"
+
+// C++ headers
+#include <iostream>
+#include <fstream>
+
+// C headers
+#include <cstdlib>
+#include <cstring>
+
+// Memory-mapped files need POSIX; elsewhere a file-backed sinogram is held
+// in memory and written to its file when synced or cleared
+#if defined(__unix__) || defined(__APPLE__)
+#define SINOGRAM_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace solutio
+{
+  Sinogram::Sinogram()
+  {
+    num_views = 0;
+    num_rows = 0;
+    num_channels = 0;
+    num_values = 0;
+    single_precision = false;
+    double_data = NULL;
+    float_data = NULL;
+    file_backed = false;
+    mapped_bytes = 0;
+  }
+
+  Sinogram::~Sinogram()
+  {
+    Clear();
+  }
+
+  bool Sinogram::Allocate(size_t n_views, int n_rows, int n_channels,
+      bool single, std::string file)
+  {
+    Clear();
+    size_t n_values = n_views*size_t(n_rows)*n_channels;
+    size_t bytes = n_values * (single ? sizeof(float) : sizeof(double));
+    if(n_values == 0) return true;
+
+    void * storage = NULL;
+#ifdef SINOGRAM_MMAP
+    if(file == "")
+#endif
+    {
+      storage = calloc(n_values, single ? sizeof(float) : sizeof(double));
+      if(storage == NULL)
+      {
+        std::cout << "Error: could not allocate " << bytes <<
+            " bytes for sinogram!\n";
+        return false;
+      }
+#ifndef SINOGRAM_MMAP
+      if(file != "")
+      {
+        file_backed = true;
+        file_name = file;
+        mapped_bytes = bytes;
+      }
+#endif
+    }
+#ifdef SINOGRAM_MMAP
+    else
+    {
+      // Create file of the full size (zero-filled) and map it
+      int fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if(fd < 0)
+      {
+        std::cout << "Error: could not open sinogram file " << file << "!\n";
+        return false;
+      }
+      if(ftruncate(fd, off_t(bytes)) != 0)
+      {
+        std::cout << "Error: could not resize sinogram file " << file << "!\n";
+        close(fd);
+        return false;
+      }
+      storage = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if(storage == MAP_FAILED)
+      {
+        std::cout << "Error: could not map sinogram file " << file << "!\n";
+        return false;
+      }
+      file_backed = true;
+      file_name = file;
+      mapped_bytes = bytes;
+    }
+#endif
+
+    num_views = n_views;
+    num_rows = n_rows;
+    num_channels = n_channels;
+    num_values = n_values;
+    single_precision = single;
+    if(single) float_data = (float *)storage;
+    else double_data = (double *)storage;
+    return true;
+  }
+
+  void Sinogram::Clear()
+  {
+    void * storage = single_precision ? (void *)float_data :
+        (void *)double_data;
+    if(storage != NULL)
+    {
+#ifdef SINOGRAM_MMAP
+      if(file_backed)
+      {
+        msync(storage, mapped_bytes, MS_SYNC);
+        munmap(storage, mapped_bytes);
+      }
+      else free(storage);
+#else
+      Sync();
+      free(storage);
+#endif
+    }
+    num_views = 0;
+    num_rows = 0;
+    num_channels = 0;
+    num_values = 0;
+    double_data = NULL;
+    float_data = NULL;
+    file_backed = false;
+    file_name = "";
+    mapped_bytes = 0;
+  }
+
+  void Sinogram::Sync()
+  {
+    if(!file_backed) return;
+    void * storage = single_precision ? (void *)float_data :
+        (void *)double_data;
+#ifdef SINOGRAM_MMAP
+    msync(storage, mapped_bytes, MS_SYNC);
+#else
+    std::ofstream file(file_name.c_str(), std::ios::binary | std::ios::trunc);
+    file.write((const char *)storage, mapped_bytes);
+    if(!file)
+    {
+      std::cout << "Error: could not write sinogram file " << file_name <<
+          "!\n";
+    }
+#endif
+  }
+
+  bool Sinogram::ReadView(size_t view, double values[]) const
+  {
+    if(view >= num_views)
+    {
+      std::cout << "Error: sinogram view " << view << " out of range (" <<
+          num_views << " views)!\n";
+      return false;
+    }
+    const size_t view_size = ViewSize();
+    const size_t offset = view_size*view;
+    if(single_precision)
+    {
+      for(size_t n = 0; n < view_size; n++) values[n] = float_data[offset+n];
+    }
+    else memcpy(values, &double_data[offset], view_size*sizeof(double));
+    return true;
+  }
+
+  bool Sinogram::WriteView(size_t view, const double values[])
+  {
+    if(view >= num_views)
+    {
+      std::cout << "Error: sinogram view " << view << " out of range (" <<
+          num_views << " views)!\n";
+      return false;
+    }
+    const size_t view_size = ViewSize();
+    const size_t offset = view_size*view;
+    if(single_precision)
+    {
+      for(size_t n = 0; n < view_size; n++)
+      {
+        float_data[offset+n] = float(values[n]);
+      }
+    }
+    else memcpy(&double_data[offset], values, view_size*sizeof(double));
+    return true;
+  }
+}
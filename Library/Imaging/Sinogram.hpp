@@ -0,0 +1,104 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright 2016-2018 Steven Dolly                                           */
+/*                                                                            */
+/* Licensed under the Apache License, Version 2.0 (the "License");            */
+/* you may not use this file except in compliance with the License.           */
+/* You may obtain a copy of the License at:                                   */
+/*                                                                            */
+/*     http://www.apache.org/licenses/LICENSE-2.0                             */
+/*                                                                            */
+/* Unless required by applicable law or agreed to in writing, software        */
+/* distributed under the License is distributed on an "AS IS" BASIS,          */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   */
+/* See the License for the specific language governing permissions and        */
+/* limitations under the License.                                             */
+/*                                                                            */
+/******************************************************************************/
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// Sinogram Storage                                                           //
+// (Sinogram.hpp)                                                             //
+//                                                                            //
+// This file contains the header for a container of CT projection data,      //
+// stored as views x rows x channels values. The storage is allocated once    //
+// with its exact size, in double or single (float) precision, either on the  //
+// heap or in a memory-mapped file so that scans larger than RAM can be       //
+// simulated and reconstructed. Values are always read and written as double. //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+// Header guard
+#ifndef SINOGRAM_HPP
+#define SINOGRAM_HPP
+
+// C++ headers
+#include <string>
+
+namespace solutio
+{
+  class Sinogram
+  {
+    public:
+      // Default constructor/destructor
+      Sinogram();
+      ~Sinogram();
+      // Storage is not shared, so the container cannot be copied
+      Sinogram(const Sinogram &) = delete;
+      Sinogram & operator=(const Sinogram &) = delete;
+      // Allocate zeroed storage for n_views x n_rows x n_channels values; if
+      // file_name is not empty, the storage is a memory-mapped file (created
+      // or overwritten). Without POSIX memory mapping, the values are kept
+      // in memory and written to the file by Sync and Clear. Returns false
+      // if the storage could not be allocated.
+      bool Allocate(size_t n_views, int n_rows, int n_channels,
+          bool single = false, std::string file_name = "");
+      // Release storage (a file-backed sinogram is flushed and kept on disk)
+      void Clear();
+      // Flush file-backed storage to disk
+      void Sync();
+      // Get dimensions and storage properties
+      size_t size() const { return num_values; }
+      size_t NumViews() const { return num_views; }
+      int NumRows() const { return num_rows; }
+      int NumChannels() const { return num_channels; }
+      size_t ViewSize() const { return size_t(num_rows)*num_channels; }
+      bool IsSinglePrecision() const { return single_precision; }
+      bool IsFileBacked() const { return file_backed; }
+      std::string GetFileName() const { return file_name; }
+      // Element access
+      double operator[](size_t n) const
+      {
+        return single_precision ? double(float_data[n]) : double_data[n];
+      }
+      void Set(size_t n, double value)
+      {
+        if(single_precision) float_data[n] = float(value);
+        else double_data[n] = value;
+      }
+      // Copy a full view (rows x channels values) out of/into storage;
+      // returns false (nothing copied) if the view is out of range
+      bool ReadView(size_t view, double values[]) const;
+      bool WriteView(size_t view, const double values[]);
+      // Direct access to storage (NULL if stored in the other precision)
+      const double * DoubleData() const { return double_data; }
+      const float * FloatData() const { return float_data; }
+    private:
+      // Dimensions
+      size_t num_views;
+      int num_rows;
+      int num_channels;
+      size_t num_values;
+      // Storage (only one of the pointers is used)
+      bool single_precision;
+      double * double_data;
+      float * float_data;
+      // Memory-mapped file properties
+      bool file_backed;
+      std::string file_name;
+      size_t mapped_bytes;
+  };
+}
+
+#endif
@@ -0,0 +1,257 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright 2016-2018 Steven Dolly                                           */
+/*                                                                            */
+/* Licensed under the Apache License, Version 2.0 (the "License");            */
+/* you may not use this file except in compliance with the License.           */
+/* You may obtain a copy of the License at:                                   */
+/*                                                                            */
+/*     http://www.apache.org/licenses/LICENSE-2.0                             */
+/*                                                                            */
+/* Unless required by applicable law or agreed to in writing, software        */
+/* distributed under the License is distributed on an "AS IS" BASIS,          */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   */
+/* See the License for the specific language governing permissions and        */
+/* limitations under the License.                                             */
+/*                                                                            */
+/******************************************************************************/
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// VoxelModelXray.cpp                                                         //
+// X-ray Imaging Voxel Model Class                                            //
+//                                                                            //
+// This main file contains a class for a voxelized object model (e.g. a       //
+// patient CT volume in HU), with specific application for x-ray imaging.     //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+// Class header
+#include "VoxelModelXray.hpp"
+
+// C++ headers
+#include <iostream>
+#include <algorithm>
+
+// C headers
+#include <cmath>
+
+// Custom headers
+#include "Utilities/DataInterpolation.hpp"
+
+namespace solutio
+{
+  VoxelModelXray::VoxelModelXray()
+  {
+    for(int a = 0; a < 3; a++)
+    {
+      dims[a] = 0;
+      spacing[a] = 0.0;
+      grid_min[a] = 0.0;
+      grid_max[a] = 0.0;
+    }
+    // 12-bit CT number range
+    hu_offset = -1024;
+    // Approximate HU to density calibration (lung/soft tissue and bone)
+    calib_hu = {-1000.0, 0.0, 1000.0, 3071.0};
+    calib_density = {0.0012, 1.0, 1.6, 2.84};
+    background_material = -1;
+  }
+
+  void VoxelModelXray::SetImage(ItkImageF3::Pointer image, bool center)
+  {
+    const ItkImageF3::SizeType &size =
+        image->GetLargestPossibleRegion().GetSize();
+    const ItkImageF3::SpacingType &s = image->GetSpacing();
+    const ItkImageF3::PointType &origin = image->GetOrigin();
+    for(int a = 0; a < 3; a++)
+    {
+      dims[a] = size[a];
+      spacing[a] = s[a] / 10.0;
+      // Origin is the center of the first voxel
+      grid_min[a] = (origin[a] / 10.0) - (spacing[a] / 2.0);
+      if(center) grid_min[a] = -0.5*spacing[a]*double(dims[a]);
+      grid_max[a] = grid_min[a] + spacing[a]*double(dims[a]);
+    }
+
+    // Store voxels as indices into the HU lookup tables
+    const size_t num_voxels = size_t(dims[0])*dims[1]*dims[2];
+    const int max_index = 4095;
+    const float * buffer = image->GetBufferPointer();
+    voxel_hu.resize(num_voxels);
+    #pragma omp parallel for
+    for(long n = 0; n < long(num_voxels); n++)
+    {
+      int index = int(round(buffer[n])) - hu_offset;
+      voxel_hu[n] = std::min(std::max(index, 0), max_index);
+    }
+    UpdateLookup();
+  }
+
+  bool VoxelModelXray::AddHURange(std::string material, double hu_min,
+      double hu_max)
+  {
+    int id = FindMaterial(material);
+    if(id < 0) return false;
+    range_material.push_back(id);
+    range_min.push_back(hu_min);
+    range_max.push_back(hu_max);
+    UpdateLookup();
+    return true;
+  }
+
+  void VoxelModelXray::SetDensityCalibration(std::vector<double> hu,
+      std::vector<double> density)
+  {
+    if(hu.size() < 2 || hu.size() != density.size())
+    {
+      std::cout << "Error: density calibration needs at least two points!\n";
+      return;
+    }
+    calib_hu = hu;
+    calib_density = density;
+    UpdateLookup();
+  }
+
+  bool VoxelModelXray::SetBackgroundMaterial(std::string material)
+  {
+    background_material = -1;
+    if(material == "") return true;
+    background_material = FindMaterial(material);
+    return (background_material >= 0);
+  }
+
+  int VoxelModelXray::FindMaterial(std::string material)
+  {
+    for(int n = 0; n < MuData.size(); n++)
+    {
+      if(material == MuData[n].GetName()) return n;
+    }
+    std::cout << "Error: material " << material << " not found!\n";
+    return -1;
+  }
+
+  void VoxelModelXray::UpdateLookup()
+  {
+    const int num_hu = 4096;
+    hu_material.assign(num_hu, -1);
+    hu_scale.assign(num_hu, 0.0);
+    int num_unassigned = 0;
+    for(int n = 0; n < num_hu; n++)
+    {
+      double hu = double(n + hu_offset);
+      // Later ranges take precedence
+      for(int r = 0; r < range_material.size(); r++)
+      {
+        if(hu >= range_min[r] && hu < range_max[r])
+        {
+          hu_material[n] = range_material[r];
+        }
+      }
+      if(hu_material[n] < 0)
+      {
+        num_unassigned++;
+        continue;
+      }
+      double density = LinearInterpolation(calib_hu, calib_density, hu);
+      hu_scale[n] = std::max(density, 0.0) /
+          MuData[hu_material[n]].GetDensity();
+    }
+    if(range_material.size() != 0 && num_unassigned != 0)
+    {
+      std::cout << "Warning: " << num_unassigned << " HU values have no " <<
+          "material and are treated as vacuum\n";
+    }
+  }
+
+  void VoxelModelXray::CalcMaterialPathlengths(const Ray3 &ray,
+      RayTraceWork &work)
+  {
+    if(work.material_lengths.size() != MuData.size()) InitRayTraceWork(work);
+    double * lengths = work.material_lengths.data();
+    for(int n = 0; n < MuData.size(); n++) lengths[n] = 0.0;
+
+    // Ray segment p(t) = origin + t*direction, 0 <= t <= 1
+    const double o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const double d[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+    const double segment_length = ray.GetLength();
+
+    // Clip segment to the voxel grid
+    double t_in = 0.0, t_out = 1.0;
+    for(int a = 0; a < 3 && t_in < t_out; a++)
+    {
+      if(d[a] == 0.0)
+      {
+        if(o[a] < grid_min[a] || o[a] >= grid_max[a]) t_out = t_in;
+        continue;
+      }
+      double t0 = (grid_min[a] - o[a]) / d[a];
+      double t1 = (grid_max[a] - o[a]) / d[a];
+      if(t0 > t1) std::swap(t0, t1);
+      t_in = std::max(t_in, t0);
+      t_out = std::min(t_out, t1);
+    }
+    if(voxel_hu.size() == 0 || t_in >= t_out)
+    {
+      if(background_material >= 0)
+      {
+        lengths[background_material] += segment_length;
+      }
+      return;
+    }
+    if(background_material >= 0)
+    {
+      lengths[background_material] += segment_length*(1.0 - (t_out - t_in));
+    }
+
+    // Initialize traversal at the entry voxel
+    int index[3], step[3];
+    double t_max[3], t_delta[3];
+    const double t_mid = 0.5*(t_in + std::min(t_out, t_in + 1.0e-9));
+    for(int a = 0; a < 3; a++)
+    {
+      double p = o[a] + t_mid*d[a];
+      index[a] = int(floor((p - grid_min[a]) / spacing[a]));
+      index[a] = std::min(std::max(index[a], 0), dims[a]-1);
+      if(d[a] > 0.0)
+      {
+        step[a] = 1;
+        t_delta[a] = spacing[a] / d[a];
+        t_max[a] = (grid_min[a] + (index[a]+1)*spacing[a] - o[a]) / d[a];
+      }
+      else if(d[a] < 0.0)
+      {
+        step[a] = -1;
+        t_delta[a] = -spacing[a] / d[a];
+        t_max[a] = (grid_min[a] + index[a]*spacing[a] - o[a]) / d[a];
+      }
+      else
+      {
+        step[a] = 0;
+        t_delta[a] = HUGE_VAL;
+        t_max[a] = HUGE_VAL;
+      }
+    }
+
+    // Step through voxels in order of boundary crossings
+    const size_t stride[3] = {1, size_t(dims[0]), size_t(dims[0])*dims[1]};
+    size_t voxel = index[0] + stride[1]*index[1] + stride[2]*index[2];
+    const int * material = hu_material.data();
+    const double * scale = hu_scale.data();
+    const unsigned short * hu = voxel_hu.data();
+    double t = t_in;
+    while(t < t_out)
+    {
+      int a = (t_max[0] < t_max[1]) ? 0 : 1;
+      if(t_max[2] < t_max[a]) a = 2;
+      double t_next = std::min(t_max[a], t_out);
+      int m = material[hu[voxel]];
+      if(m >= 0) lengths[m] += (t_next - t)*segment_length*scale[hu[voxel]];
+      t = t_next;
+      index[a] += step[a];
+      if(index[a] < 0 || index[a] >= dims[a]) break;
+      voxel += step[a]*long(stride[a]);
+      t_max[a] += t_delta[a];
+    }
+  }
+}
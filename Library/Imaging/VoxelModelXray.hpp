@@ -0,0 +1,93 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright 2016-2018 Steven Dolly                                           */
+/*                                                                            */
+/* Licensed under the Apache License, Version 2.0 (the "License");            */
+/* you may not use this file except in compliance with the License.           */
+/* You may obtain a copy of the License at:                                   */
+/*                                                                            */
+/*     http://www.apache.org/licenses/LICENSE-2.0                             */
+/*                                                                            */
+/* Unless required by applicable law or agreed to in writing, software        */
+/* distributed under the License is distributed on an "AS IS" BASIS,          */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   */
+/* See the License for the specific language governing permissions and        */
+/* limitations under the License.                                             */
+/*                                                                            */
+/******************************************************************************/
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// VoxelModelXray.hpp                                                         //
+// X-ray Imaging Voxel Model Class                                            //
+//                                                                            //
+// This header file contains a class for a voxelized object model (e.g. a     //
+// patient CT volume in HU), with specific application for x-ray imaging.     //
+// Each voxel is assigned a material and a density scale from its HU value,   //
+// and rays are traced through the voxel grid with the Amanatides-Woo (3D     //
+// DDA) algorithm to give the radiological path length in each material.      //
+// Ray tracing only reads model data, so it may be done from many threads.    //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+// Header guard
+#ifndef VOXELMODELXRAY_HPP
+#define VOXELMODELXRAY_HPP
+
+// C++ headers
+#include <string>
+#include <vector>
+
+// Custom headers
+#include "Imaging/ObjectModelXray.hpp"
+#include "Utilities/SolutioItk.hpp"
+
+namespace solutio
+{
+  class VoxelModelXray : public ObjectModelXray
+  {
+    public:
+      // Default constructor
+      VoxelModelXray();
+      // Load voxel HU values from image (ITK coordinates in mm, converted to
+      // cm); if center is true, the volume is centered at the origin
+      void SetImage(ItkImageF3::Pointer image, bool center = true);
+      // Assign a material (added with AddMaterial) to voxels with
+      // hu_min <= HU < hu_max
+      bool AddHURange(std::string material, double hu_min, double hu_max);
+      // Set HU to mass density (g/cm^3) calibration curve (piecewise linear,
+      // HU values in increasing order); voxel path lengths are scaled by
+      // voxel density over nominal material density
+      void SetDensityCalibration(std::vector<double> hu,
+          std::vector<double> density);
+      // Material assigned to the ray path outside the voxel grid (e.g. air,
+      // to match the air scan); empty name = none
+      bool SetBackgroundMaterial(std::string material);
+      // Radiological path length through each material
+      void CalcMaterialPathlengths(const Ray3 &ray, RayTraceWork &work);
+    private:
+      // Rebuild HU lookup tables from ranges and calibration
+      void UpdateLookup();
+      int FindMaterial(std::string material);
+      // Voxel grid (x index fastest); values are indices into HU lookup
+      int dims[3];
+      double spacing[3];
+      double grid_min[3];
+      double grid_max[3];
+      std::vector<unsigned short> voxel_hu;
+      // HU lookup tables (integer HU from hu_offset), material ID (-1 for
+      // none) and density scale for each HU
+      int hu_offset;
+      std::vector<int> hu_material;
+      std::vector<double> hu_scale;
+      // HU ranges and density calibration
+      std::vector<int> range_material;
+      std::vector<double> range_min;
+      std::vector<double> range_max;
+      std::vector<double> calib_hu;
+      std::vector<double> calib_density;
+      int background_material;
+  };
+}
+
+#endif
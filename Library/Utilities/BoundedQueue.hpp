@@ -0,0 +1,96 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright 2016-2018 Steven Dolly                                           */
+/*                                                                            */
+/* Licensed under the Apache License, Version 2.0 (the "License");            */
+/* you may not use this file except in compliance with the License.           */
+/* You may obtain a copy of the License at:                                   */
+/*                                                                            */
+/*     http://www.apache.org/licenses/LICENSE-2.0                             */
+/*                                                                            */
+/* Unless required by applicable law or agreed to in writing, software        */
+/* distributed under the License is distributed on an "AS IS" BASIS,          */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   */
+/* See the License for the specific language governing permissions and        */
+/* limitations under the License.                                             */
+/*                                                                            */
+/******************************************************************************/
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// BoundedQueue.hpp                                                           //
+// Bounded Thread-Safe Queue                                                  //
+//                                                                            //
+// This header file contains a template class for a first-in, first-out      //
+// queue with a maximum size, used to pass data between the stages of a      //
+// multi-threaded pipeline. Push waits while the queue is full, and Pop      //
+// waits while it is empty, so a fast stage cannot run far ahead of a slow   //
+// one. Once the producer closes the queue, Pop returns false when no items  //
+// are left.                                                                  //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+// Header guard
+#ifndef BOUNDEDQUEUE_HPP
+#define BOUNDEDQUEUE_HPP
+
+// C++ headers
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace solutio
+{
+  template <class T>
+  class BoundedQueue
+  {
+    public:
+      // Constructor with maximum number of queued items
+      BoundedQueue(size_t max_size) : capacity(max_size), closed(false)
+      {
+        if(capacity == 0) capacity = 1;
+      }
+      // Add item, waiting for space; returns false if the queue is closed
+      bool Push(T item)
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock,
+            [this]{ return closed || items.size() < capacity; });
+        if(closed) return false;
+        items.push_back(std::move(item));
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+      }
+      // Remove item, waiting for one; returns false if the queue is closed
+      // and empty
+      bool Pop(T &item)
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]{ return closed || !items.empty(); });
+        if(items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+      }
+      // No more items will be added; waiting threads are released
+      void Close()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+      }
+    private:
+      size_t capacity;
+      bool closed;
+      std::deque<T> items;
+      std::mutex mutex;
+      std::condition_variable not_empty;
+      std::condition_variable not_full;
+  };
+}
+
+#endif
@@ -22,7 +22,8 @@
 // File Read/Write Helper Functions                                           //
 // Created November 3, 2017 (Steven Dolly)                                    //
 //                                                                            //
-// This main file contains helper functions to read/write text files.         //
+// This main file contains helper functions to read/write text files, and    //
+// to write binary (raw or MetaImage) data files.                             //
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -31,6 +32,9 @@
 
 // Standard C++ header files
 #include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
 
 namespace solutio
 {
@@ -50,4 +54,55 @@ namespace solutio
     LineRead(s, delim, elems);
     return elems;
   }
+
+  bool WriteBinaryChunked(std::string file_name, const char * data,
+      size_t n_bytes)
+  {
+    const size_t chunk_bytes = size_t(1) << 24;
+    std::ofstream fout(file_name.c_str(), std::ios::out | std::ios::binary);
+    if(!fout.is_open())
+    {
+      std::cout << "Error: could not open " << file_name << " for writing!\n";
+      return false;
+    }
+    for(size_t offset = 0; offset < n_bytes; offset += chunk_bytes)
+    {
+      size_t bytes = std::min(chunk_bytes, n_bytes - offset);
+      fout.write(data + offset, bytes);
+      if(!fout.good())
+      {
+        std::cout << "Error: could not write to " << file_name << "!\n";
+        return false;
+      }
+    }
+    fout.close();
+    return true;
+  }
+
+  bool WriteMetaImageHeader(std::string header_name, std::string data_name,
+      const std::vector<int> &dims, const std::vector<double> &spacing,
+      std::string element_type)
+  {
+    std::ofstream fout(header_name.c_str());
+    if(!fout.is_open())
+    {
+      std::cout << "Error: could not open " << header_name << " for writing!\n";
+      return false;
+    }
+    // Data file is referenced relative to the header
+    size_t slash = data_name.find_last_of('/');
+    if(slash != std::string::npos) data_name = data_name.substr(slash+1);
+    fout << "ObjectType = Image\n";
+    fout << "NDims = " << dims.size() << '\n';
+    fout << "BinaryData = True\n";
+    fout << "BinaryDataByteOrderMSB = False\n";
+    fout << "DimSize =";
+    for(int n = 0; n < dims.size(); n++) fout << ' ' << dims[n];
+    fout << "\nElementSpacing =";
+    for(int n = 0; n < spacing.size(); n++) fout << ' ' << spacing[n];
+    fout << "\nElementType = " << element_type << '\n';
+    fout << "ElementDataFile = " << data_name << '\n';
+    fout.close();
+    return true;
+  }
 }
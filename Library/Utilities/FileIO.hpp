@@ -22,7 +22,8 @@
 // File Read/Write Helper Functions                                           //
 // Created November 3, 2017 (Steven Dolly)                                    //
 //                                                                            //
-// This header file contains helper functions to read/write text files.       //
+// This header file contains helper functions to read/write text files, and  //
+// to write binary (raw or MetaImage) data files.                             //
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -38,6 +39,14 @@ namespace solutio
 {
   void LineRead(const std::string &s, char delim, std::vector<std::string> &elems);
   std::vector<std::string> LineRead(const std::string &s, char delim);
+  // Write binary data to file in large sequential chunks
+  bool WriteBinaryChunked(std::string file_name, const char * data,
+      size_t n_bytes);
+  // Write MetaImage header (.mhd) describing a raw binary data file; element
+  // type is a MetaImage type name, e.g. "MET_FLOAT"
+  bool WriteMetaImageHeader(std::string header_name, std::string data_name,
+      const std::vector<int> &dims, const std::vector<double> &spacing,
+      std::string element_type);
 }
 
 // End header guard
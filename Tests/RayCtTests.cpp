@@ -0,0 +1,276 @@
+/******************************************************************************/
+/*                                                                            */
+/* Copyright 2018 Steven Dolly                                                */
+/*                                                                            */
+/* Licensed under the Apache License, Version 2.0 (the "License");            */
+/* you may not use this file except in compliance with the License.           */
+/* You may obtain a copy of the License at:                                   */
+/*                                                                            */
+/*     http://www.apache.org/licenses/LICENSE-2.0                             */
+/*                                                                            */
+/* Unless required by applicable law or agreed to in writing, software        */
+/* distributed under the License is distributed on an "AS IS" BASIS,          */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.   */
+/* See the License for the specific language governing permissions and        */
+/* limitations under the License.                                             */
+/*                                                                            */
+/******************************************************************************/
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// RayCtTests.cpp                                                             //
+// Tests of RayCT CT simulation and reconstruction                            //
+//                                                                            //
+// This file checks RayCT simulation and reconstruction features (and         //
+// the object models they use) against analytic values or against the         //
+// results of the standard RayCT paths. Tests are run from the build folder,  //
+// which has a copy of the Data folder.                                       //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+// C++ header files
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// SolutioCpp library headers
+#include "Geometry/Cylinder.hpp"
+#include "Geometry/Ray3.hpp"
+#include "Imaging/ObjectModelXray.hpp"
+#include "Imaging/RayCT.hpp"
+#include "Imaging/VoxelModelXray.hpp"
+
+namespace
+{
+  const std::string nist_folder = "Data/NISTX";
+
+  // Water cylinder with an off-center bone insert, in air
+  struct CylinderPhantom
+  {
+    CylinderPhantom() : world(solutio::Vec3<double>(), 40.0, 20.0),
+        phantom(solutio::Vec3<double>(), 10.0, 10.0),
+        insert(solutio::Vec3<double>(4.0, 3.0, 0.0), 2.0, 10.0)
+    {
+      model.AddMaterial(nist_folder, "Air", "Air");
+      model.AddMaterial(nist_folder, "Water", "Water");
+      model.AddMaterial(nist_folder, "Bone", "Bone");
+      model.AddObject("World", world, "None", "Air");
+      model.AddObject("Phantom", phantom, "World", "Water");
+      model.AddObject("Insert", insert, "Phantom", "Bone");
+      model.MakeTree();
+    }
+    solutio::Cylinder world, phantom, insert;
+    solutio::ObjectModelXray model;
+  };
+
+  // Small axial scanner (single row by default)
+  void SetAxialScan(solutio::RayCT &S, int n_rows = 1)
+  {
+    S.SetVerbose(false);
+    S.SetNistDataFolder(nist_folder);
+    S.SetGeometry(40.0, 672, 0.0625, n_rows, 0.0625);
+    S.SetAcquisition(120, 1.0e12, 120);
+    S.SetReconstruction(40.0, 96);
+    S.SetRandomSeed(7);
+  }
+
+  // Largest HU difference between the last reconstructed slice(s) and a
+  // reference (each recon appends its slices to the image data)
+  int MaxDifference(const std::vector<int> &image,
+      const std::vector<int> &reference)
+  {
+    if(image.size() < reference.size()) return -1;
+    const int * last = &image[image.size() - reference.size()];
+    int max_diff = 0;
+    for(size_t n = 0; n < reference.size(); n++)
+    {
+      max_diff = std::max(max_diff, std::abs(last[n] - reference[n]));
+    }
+    return max_diff;
+  }
+}
+
+TEST_CASE("Voxel model path lengths match the ray geometry", "[user-010]")
+{
+  // 10 x 10 x 10 cm water cube (1 cm voxels) centered at the origin
+  auto image = solutio::ItkImageF3::New();
+  itk::Size<3> size;
+  size[0] = size[1] = size[2] = 10;
+  image->SetRegions(size);
+  image->Allocate();
+  double spacing[3] = {10.0, 10.0, 10.0};
+  image->SetSpacing(spacing);
+  image->FillBuffer(0.0);
+
+  solutio::VoxelModelXray V;
+  V.AddMaterial(nist_folder, "Air", "Air");
+  V.AddMaterial(nist_folder, "Water", "Water");
+  V.AddHURange("Air", -2000.0, -500.0);
+  V.AddHURange("Water", -500.0, 3000.0);
+  V.SetDensityCalibration({-1000.0, 3000.0}, {1.0, 1.0});
+  V.SetBackgroundMaterial("Air");
+  V.SetImage(image, true);
+
+  solutio::RayTraceWork work;
+  SECTION("Axis-aligned ray")
+  {
+    solutio::Ray3 ray(solutio::Vec3<double>(-20.0, 0.3, 0.7),
+        solutio::Vec3<double>(40.0, 0.0, 0.0));
+    V.CalcMaterialPathlengths(ray, work);
+    REQUIRE(work.material_lengths[0] == Approx(30.0));
+    REQUIRE(work.material_lengths[1] == Approx(10.0));
+  }
+  SECTION("Oblique ray through the center")
+  {
+    solutio::Ray3 ray(solutio::Vec3<double>(-20.0, -20.0, 0.2),
+        solutio::Vec3<double>(40.0, 40.0, 0.0));
+    V.CalcMaterialPathlengths(ray, work);
+    REQUIRE(work.material_lengths[0] == Approx(30.0*std::sqrt(2.0)));
+    REQUIRE(work.material_lengths[1] == Approx(10.0*std::sqrt(2.0)));
+  }
+  SECTION("Ray missing the grid")
+  {
+    solutio::Ray3 ray(solutio::Vec3<double>(-20.0, 6.0, 0.0),
+        solutio::Vec3<double>(40.0, 0.0, 0.0));
+    V.CalcMaterialPathlengths(ray, work);
+    REQUIRE(work.material_lengths[0] == Approx(40.0));
+    REQUIRE(work.material_lengths[1] == 0.0);
+  }
+}
+
+TEST_CASE("Noise realizations do not depend on thread count", "[user-018]")
+{
+  CylinderPhantom P;
+  std::vector<std::vector<double>> realizations[2];
+  for(int t = 0; t < 2; t++)
+  {
+    solutio::RayCT S;
+    SetAxialScan(S);
+    S.SetAcquisition(120, 1.0e5, 120);
+    S.SetNumThreads(t + 1);
+    S.SetRandomSeed(42);
+    S.SetKeepExpectedCounts(true);
+    S.AcquireAirScan();
+    S.AcquireAxialProjections(P.model, 0.0);
+    S.GenerateNoiseRealizations(3, [&](int /*k*/){
+      const solutio::Sinogram &proj = S.GetProjectionData();
+      std::vector<double> values(proj.size());
+      for(size_t n = 0; n < proj.size(); n++) values[n] = proj[n];
+      realizations[t].push_back(values);
+    });
+  }
+  REQUIRE(realizations[0].size() == 3);
+  REQUIRE(realizations[1].size() == 3);
+  for(int k = 0; k < 3; k++)
+  {
+    REQUIRE(realizations[0][k] == realizations[1][k]);
+  }
+  // Realizations are independent
+  REQUIRE(realizations[0][0] != realizations[0][1]);
+}
+
+TEST_CASE("Streaming FBP matches batch FBP", "[user-020]")
+{
+  CylinderPhantom P;
+  solutio::RayCT S;
+  SetAxialScan(S);
+  S.SetNumThreads(4);
+  S.AcquireAirScan();
+  S.AcquireAxialProjections(P.model, 0.0);
+  S.ReconAxialFBP();
+  std::vector<int> batch_image = S.GetImageData();
+
+  SECTION("Views simulated on the fly")
+  {
+    S.StreamAxialFBP(P.model, 0.0, 8);
+    REQUIRE(S.GetImageData().size() == 2*batch_image.size());
+    REQUIRE(MaxDifference(S.GetImageData(), batch_image) <= 1);
+  }
+  SECTION("Views read from the projection data")
+  {
+    S.StreamAxialFBP(2);
+    REQUIRE(S.GetImageData().size() == 2*batch_image.size());
+    REQUIRE(MaxDifference(S.GetImageData(), batch_image) <= 1);
+  }
+}
+
+TEST_CASE("Resumed helical acquisition matches an uninterrupted one",
+    "[user-021]")
+{
+  CylinderPhantom P;
+  const std::string file_name = "RayCtTests_checkpoint.bin";
+  const int n_rows = 4;
+  solutio::RayCT S;
+  SetAxialScan(S, n_rows);
+  S.SetAcquisition(120, 1.0e12, 60);
+  S.AcquireAirScan();
+  S.SetCheckpoint(file_name, 25);
+  S.AcquireHelicalProjections(P.model, 1.0, -0.5, 2);
+  const solutio::Sinogram &full = S.GetProjectionData();
+  std::vector<double> full_data(full.size());
+  for(size_t n = 0; n < full.size(); n++) full_data[n] = full[n];
+
+  // Mark only the first 50 views as completed and clear the rest, as if
+  // the run had stopped
+  const size_t view_bytes = sizeof(double)*n_rows*672;
+  std::fstream file(file_name.c_str(),
+      std::ios::in | std::ios::out | std::ios::binary);
+  file.seekg(0, std::ios::end);
+  long long count_offset = (long long)file.tellg() - sizeof(long long) -
+      view_bytes*full.NumViews();
+  long long completed = 0;
+  file.seekg(count_offset);
+  file.read((char *)&completed, sizeof(completed));
+  REQUIRE(completed == (long long)full.NumViews());
+  completed = 50;
+  file.seekp(count_offset);
+  file.write((const char *)&completed, sizeof(completed));
+  std::vector<char> zeros(view_bytes, 0);
+  file.seekp(count_offset + sizeof(long long) + view_bytes*completed);
+  for(size_t n = completed; n < full.NumViews(); n++)
+  {
+    file.write(&zeros[0], view_bytes);
+  }
+  REQUIRE(file.good());
+  file.close();
+
+  solutio::RayCT R;
+  R.SetVerbose(false);
+  R.SetNistDataFolder(nist_folder);
+  REQUIRE(R.ResumeHelicalProjections(P.model, file_name));
+  const solutio::Sinogram &resumed = R.GetProjectionData();
+  REQUIRE(resumed.size() == full_data.size());
+  bool identical = true;
+  for(size_t n = 0; n < resumed.size(); n++)
+  {
+    if(resumed[n] != full_data[n]) identical = false;
+  }
+  REQUIRE(identical);
+
+  // A different NIST data folder is refused
+  solutio::RayCT W;
+  W.SetVerbose(false);
+  W.SetNistDataFolder("Data");
+  REQUIRE_FALSE(W.ResumeHelicalProjections(P.model, file_name));
+  std::remove(file_name.c_str());
+}
+
+TEST_CASE("Float backprojection is within 1 HU of double", "[user-025]")
+{
+  CylinderPhantom P;
+  solutio::RayCT S;
+  SetAxialScan(S);
+  S.AcquireAirScan();
+  S.AcquireAxialProjections(P.model, 0.0);
+  S.ReconAxialFBP();
+  std::vector<int> double_image = S.GetImageData();
+  S.SetFloatBackprojection(true);
+  S.ReconAxialFBP();
+  REQUIRE(S.GetImageData().size() == 2*double_image.size());
+  REQUIRE(MaxDifference(S.GetImageData(), double_image) <= 1);
+}